@@ -0,0 +1,444 @@
+/* vim: ts=4 sw=4 sts=4 et tw=78
+ * Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+ */
+#include "ffi.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+/* ffi.async(fn, ...) or fn:async(...) runs a C function call on a fixed pool
+ * of worker threads, one per cpu, started the first time it's used. It
+ * returns a handle straight away. h:ready() returns whether the call has
+ * finished and h:wait() blocks until it has and returns the result. A
+ * coroutine can wait without blocking the lua_State with:
+ *
+ *     while not h:ready() do coroutine.yield() end
+ *
+ * The arguments are converted on the calling thread into one 8 byte slot
+ * each, which the code from compile_packed_call loads into registers, so the
+ * workers never touch the lua_State. The handle keeps the function and
+ * arguments alive. Collecting it takes a call that hasn't started yet off
+ * the queue and waits for one that has.
+ */
+
+#define ASYNC_MAX_ARGS 14
+#define ASYNC_MAX_THREADS 64
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION pool_mutex;
+typedef CONDITION_VARIABLE pool_cond;
+typedef HANDLE pool_thread;
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c)
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t pool_mutex;
+typedef pthread_cond_t pool_cond;
+typedef pthread_t pool_thread;
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+};
+
+typedef void (*packed_call)(cfunction func, uint64_t* args, uint64_t* ret);
+
+/* stored in the handle userdata */
+struct async_job {
+    struct async_job* next;
+    packed_call call;
+    cfunction func;
+    int state; /* JOB_*, protected by the pool lock */
+    uint64_t ret;
+    uint64_t args[ASYNC_MAX_ARGS];
+};
+
+struct async_pool {
+    pool_mutex lock;
+    pool_cond work; /* signalled when a job is queued or on stop */
+    pool_cond done; /* broadcast when a job finishes */
+    struct async_job* head;
+    struct async_job** tail;
+    int stop;
+    int nthreads;
+    pool_thread threads[ASYNC_MAX_THREADS];
+};
+
+static void run_jobs(struct async_pool* pool)
+{
+    mutex_lock(&pool->lock);
+
+    for (;;) {
+        struct async_job* job;
+
+        while (!pool->stop && pool->head == NULL) {
+            cond_wait(&pool->work, &pool->lock);
+        }
+
+        if (pool->stop) {
+            break;
+        }
+
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = &pool->head;
+        }
+        job->state = JOB_RUNNING;
+        mutex_unlock(&pool->lock);
+
+        job->call(job->func, job->args, &job->ret);
+
+        mutex_lock(&pool->lock);
+        job->state = JOB_DONE;
+        cond_broadcast(&pool->done);
+    }
+
+    mutex_unlock(&pool->lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID pool)
+{
+    run_jobs((struct async_pool*) pool);
+    return 0;
+}
+#else
+static void* worker_main(void* pool)
+{
+    run_jobs((struct async_pool*) pool);
+    return NULL;
+}
+#endif
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int) si.dwNumberOfProcessors;
+#else
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return num > 0 ? (int) num : 1;
+#endif
+}
+
+static struct async_pool* get_async_pool(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+    struct async_pool* pool;
+    int i, num;
+
+    if (jit->async) {
+        return jit->async;
+    }
+
+    pool = (struct async_pool*) calloc(1, sizeof(struct async_pool));
+    if (pool == NULL) {
+        luaL_error(L, "out of memory");
+    }
+
+    mutex_init(&pool->lock);
+    cond_init(&pool->work);
+    cond_init(&pool->done);
+    pool->tail = &pool->head;
+
+    num = cpu_count();
+    if (num > ASYNC_MAX_THREADS) {
+        num = ASYNC_MAX_THREADS;
+    }
+
+    for (i = 0; i < num; i++) {
+#ifdef _WIN32
+        pool->threads[i] = CreateThread(NULL, 0, &worker_main, pool, 0, NULL);
+        if (pool->threads[i] == NULL) {
+            break;
+        }
+#else
+        if (pthread_create(&pool->threads[i], NULL, &worker_main, pool)) {
+            break;
+        }
+#endif
+        pool->nthreads++;
+    }
+
+    jit->async = pool;
+
+    if (pool->nthreads == 0) {
+        free_async_pool(jit);
+        luaL_error(L, "failed to start the async worker threads");
+    }
+
+    return pool;
+}
+
+/* free_async_pool stops the workers once they finish their current job.
+ * Jobs still in the queue are never run. */
+void free_async_pool(struct jit* jit)
+{
+    struct async_pool* pool = jit->async;
+    struct async_job* job;
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    mutex_lock(&pool->lock);
+    pool->stop = 1;
+    cond_broadcast(&pool->work);
+    mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+
+    for (job = pool->head; job != NULL; job = job->next) {
+        job->state = JOB_DONE;
+    }
+
+    cond_destroy(&pool->work);
+    cond_destroy(&pool->done);
+    mutex_destroy(&pool->lock);
+    free(pool);
+    jit->async = NULL;
+}
+
+static struct async_job* check_job(lua_State* L, int idx)
+{
+    if (!lua_getmetatable(L, idx) || !is_metatable(L, -1, &async_mt_key)) {
+        luaL_argerror(L, idx, "expected an async handle");
+    }
+    lua_pop(L, 1);
+    return (struct async_job*) lua_touserdata(L, idx);
+}
+
+/* index into the keep alive table in the handle's user value */
+#define JOB_USR_IDX 1 /* function usr table */
+#define JOB_CODE_IDX 2 /* the code from compile_packed_call */
+#define JOB_ARGS_IDX 3 /* the function followed by the arguments */
+
+/* ffi.async(fn, ...) queues a call to fn with the given arguments on the
+ * worker threads and returns a handle for the result */
+int ffi_async(lua_State* L)
+{
+    struct ctype ct;
+    cfunction* pf;
+    cfunction call;
+    struct async_job* job;
+    struct async_pool* pool;
+    int i, nargs, top = lua_gettop(L);
+
+    if (lua_iscfunction(L, 1) && lua_getupvalue(L, 1, 1)) {
+        /* functions in libraries are closures with the function cdata as
+         * the first upvalue */
+        lua_replace(L, 1);
+    }
+
+    pf = (cfunction*) to_cdata(L, 1, &ct);
+    if (!pf || ct.pointers || (ct.type != FUNCTION_PTR_TYPE && ct.type != FUNCTION_TYPE)) {
+        return luaL_argerror(L, 1, "expected a C function");
+    }
+
+    if (*pf == NULL) {
+        return luaL_argerror(L, 1, "NULL function");
+    }
+
+    if (ct.is_jitted && !ct.queued) {
+        return luaL_argerror(L, 1, "lua callbacks can only be called from the async threads if queued");
+    }
+
+    nargs = (int) lua_rawlen(L, top+1);
+    if (nargs > ASYNC_MAX_ARGS) {
+        return luaL_error(L, "NYI: async calls with more than %d arguments", ASYNC_MAX_ARGS);
+    }
+
+    if (top - 1 != nargs) {
+        return luaL_error(L, "incorrect number of arguments, expected %d", nargs);
+    }
+
+    call = compile_packed_call(L, top+1, &ct);
+
+    job = (struct async_job*) lua_newuserdata(L, sizeof(struct async_job));
+    memset(job, 0, sizeof(*job));
+    job->state = JOB_DONE;
+    push_upval(L, &async_mt_key);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, top + 2, 0);
+    lua_pushvalue(L, top+1);
+    lua_rawseti(L, -2, JOB_USR_IDX);
+    lua_pushvalue(L, top+2);
+    lua_rawseti(L, -2, JOB_CODE_IDX);
+    for (i = 1; i <= top; i++) {
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, JOB_ARGS_IDX + i - 1);
+    }
+    lua_setuservalue(L, -2);
+
+    for (i = 1; i <= nargs; i++) {
+        const struct ctype* mt;
+
+        /* these would be converted to unqueued lua callbacks */
+        if (lua_isfunction(L, i+1)) {
+            return luaL_argerror(L, i+1, "functions can't be called from the async threads");
+        }
+
+        lua_rawgeti(L, top+1, i);
+        mt = (const struct ctype*) lua_touserdata(L, -1);
+        lua_getuservalue(L, -1);
+        set_value(L, i+1, &job->args[i-1], lua_gettop(L), mt, 1);
+        lua_pop(L, 2);
+    }
+
+    job->call = (packed_call) call;
+    job->func = *pf;
+
+    pool = get_async_pool(L);
+    mutex_lock(&pool->lock);
+    job->state = JOB_QUEUED;
+    *pool->tail = job;
+    pool->tail = &job->next;
+    cond_signal(&pool->work);
+    mutex_unlock(&pool->lock);
+
+    return 1;
+}
+
+/* h:ready() returns whether the call has finished */
+int async_ready(lua_State* L)
+{
+    struct async_job* job = check_job(L, 1);
+    struct async_pool* pool = get_jit(L)->async;
+    int done;
+
+    if (pool) {
+        mutex_lock(&pool->lock);
+        done = (job->state == JOB_DONE);
+        mutex_unlock(&pool->lock);
+    } else {
+        done = 1;
+    }
+
+    lua_pushboolean(L, done);
+    return 1;
+}
+
+/* h:wait() waits for the call to finish and returns its result */
+int async_wait(lua_State* L)
+{
+    struct async_job* job = check_job(L, 1);
+    struct async_pool* pool = get_jit(L)->async;
+    const struct ctype* rt;
+    void* ret = &job->ret;
+
+    if (pool) {
+        mutex_lock(&pool->lock);
+        while (job->state != JOB_DONE) {
+            cond_wait(&pool->done, &pool->lock);
+        }
+        mutex_unlock(&pool->lock);
+    }
+
+    lua_settop(L, 1);
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, 2, JOB_USR_IDX);
+    lua_rawgeti(L, 3, 0);
+    rt = (const struct ctype*) lua_touserdata(L, 4);
+
+    if (rt->pointers) {
+        lua_getuservalue(L, 4);
+        *(void**) push_cdata(L, -1, rt) = *(void**) ret;
+        return 1;
+    }
+
+    switch (rt->type) {
+    case VOID_TYPE:
+        return 0;
+    case BOOL_TYPE:
+        lua_pushboolean(L, *(_Bool*) ret);
+        return 1;
+    case INT8_TYPE:
+        lua_pushnumber(L, rt->is_unsigned ? (lua_Number) *(uint8_t*) ret : (lua_Number) *(int8_t*) ret);
+        return 1;
+    case INT16_TYPE:
+        lua_pushnumber(L, rt->is_unsigned ? (lua_Number) *(uint16_t*) ret : (lua_Number) *(int16_t*) ret);
+        return 1;
+    case ENUM_TYPE:
+    case INT32_TYPE:
+        lua_pushnumber(L, rt->is_unsigned ? (lua_Number) *(uint32_t*) ret : (lua_Number) *(int32_t*) ret);
+        return 1;
+    case INT64_TYPE:
+        *(int64_t*) push_cdata(L, 0, rt) = *(int64_t*) ret;
+        return 1;
+    case INTPTR_TYPE:
+    case FUNCTION_PTR_TYPE:
+        lua_getuservalue(L, 4);
+        *(void**) push_cdata(L, -1, rt) = *(void**) ret;
+        return 1;
+    case FLOAT_TYPE:
+        lua_pushnumber(L, *(float*) ret);
+        return 1;
+    case DOUBLE_TYPE:
+        lua_pushnumber(L, *(double*) ret);
+        return 1;
+    default:
+        return luaL_error(L, "NYI: async return type");
+    }
+}
+
+int async_gc(lua_State* L)
+{
+    struct async_job* job = (struct async_job*) lua_touserdata(L, 1);
+    struct async_pool* pool = get_jit(L)->async;
+
+    if (pool == NULL) {
+        return 0;
+    }
+
+    mutex_lock(&pool->lock);
+
+    if (job->state == JOB_QUEUED) {
+        struct async_job** pjob;
+        for (pjob = &pool->head; *pjob != NULL; pjob = &(*pjob)->next) {
+            if (*pjob == job) {
+                *pjob = job->next;
+                if (pool->tail == &job->next) {
+                    pool->tail = pjob;
+                }
+                break;
+            }
+        }
+        job->state = JOB_DONE;
+    }
+
+    while (job->state != JOB_DONE) {
+        cond_wait(&pool->done, &pool->lock);
+    }
+
+    mutex_unlock(&pool->lock);
+    return 0;
+}
@@ -0,0 +1,389 @@
+-- vim: ts=4 sw=4 sts=4 et tw=78
+-- Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+--
+-- Simple benchmarks, run with make bench.
+
+io.stdout:setvbuf('no')
+local ffi = require 'ffi'
+
+local function bench(name, n, f)
+    collectgarbage()
+    local start = os.clock()
+    f(n)
+    local t = os.clock() - start
+    print(string.format('%-24s %8d %10.3f ms %10.3f us/op', name, n, t * 1e3, t * 1e6 / n))
+end
+
+local N = 10000
+
+local function bind_callbacks(n)
+    local cbs = {}
+    for i = 1, n do
+        cbs[i] = ffi.cast('int (*)(int)', function(x) return x + i end)
+    end
+    for i = 1, n do
+        cbs[i]:free()
+    end
+end
+
+-- bench.lua mprotect times compiling callbacks in a process started with
+-- LUA_FFI_NO_DOUBLE_MAP set, so that the double mapped jit code allocator
+-- can be compared with the mprotect path
+if arg[1] == 'mprotect' then
+    bench('bind callbacks mprotect', N, bind_callbacks)
+    return
+end
+
+-- bench.lua cdef [cachedir] times a large cdef on its own in a fresh process
+-- so that the cdef cache can be measured cold and warm
+if arg[1] == 'cdef' then
+    local decl = {}
+    for i = 1, 2000 do
+        decl[#decl+1] = string.format('struct cdef_%d { int a; double b; struct cdef_%d* next; char name[16]; };', i, i)
+        decl[#decl+1] = string.format('int cdef_fn_%d(struct cdef_%d* s, const char* fmt, ...);', i, i)
+    end
+    if arg[2] then
+        ffi.cachedir(arg[2])
+    end
+    local start = os.clock()
+    ffi.cdef(table.concat(decl, '\n'))
+    print(os.clock() - start)
+    return
+end
+
+local c = ffi.load('test_cdecl')
+
+do
+    local function run(dir)
+        local out = os.tmpname()
+        os.execute(string.format('%s bench.lua cdef %s > %s', arg[-1] or 'lua', dir or '', out))
+        local f = io.open(out)
+        local t = tonumber(f:read('*a'))
+        f:close()
+        os.remove(out)
+        print(string.format('%-24s %8d %10.3f ms', dir and 'cdef cached' or 'cdef', 1, t * 1e3))
+    end
+
+    local dir = os.tmpname()
+    os.remove(dir)
+    os.execute('mkdir ' .. dir)
+    run(nil)
+    run(dir) -- cold, parses and saves
+    run(dir) -- warm, loads the saved tables
+    os.execute('rm -r ' .. dir)
+end
+
+do
+    local decl = {}
+    for i = 1, N do
+        decl[#decl+1] = string.format('int32_t bench_add_%d(int32_t, int32_t) __asm__("add_i32");', i)
+        decl[#decl+1] = string.format('int32_t bench_bind_%d(int32_t, int32_t) __asm__("add_i32");', i)
+    end
+    ffi.cdef(table.concat(decl, '\n'))
+end
+
+bench('bind functions', N, function(n)
+    for i = 1, n do
+        local _ = c['bench_add_' .. i]
+    end
+end)
+
+bench('ffi.bind functions', N, function(n)
+    local names = {}
+    for i = 1, n do
+        names[i] = 'bench_bind_' .. i
+    end
+    ffi.bind(c, names)
+end)
+
+bench('bind callbacks', N, bind_callbacks)
+os.execute(string.format('LUA_FFI_NO_DOUBLE_MAP=1 %s bench.lua mprotect', arg[-1] or 'lua'))
+
+ffi.cdef 'int snprintf(char* buf, size_t sz, const char* fmt, ...);'
+
+bench('variadic calls', 10 * N, function(n)
+    local buf = ffi.new('char[64]')
+    local snprintf = ffi.C.snprintf
+    for i = 1, n do
+        snprintf(buf, 0, '', i, 'x', true, i)
+    end
+end)
+
+ffi.cdef 'int count_varargs(int n, ...);'
+
+bench('trivial variadic calls', 10 * N, function(n)
+    local f = c.count_varargs
+    for i = 1, n do
+        f(3, i, 'x', true)
+    end
+end)
+
+ffi.cdef [[
+int32_t bench_errno(int32_t, int32_t) __asm__("add_i32");
+int32_t bench_noerrno(int32_t, int32_t) __asm__("add_i32") __attribute__((noerrno));
+]]
+
+bench('calls', 10 * N, function(n)
+    local f = c.bench_errno
+    for i = 1, n do
+        f(i, 1)
+    end
+end)
+
+bench('calls without errno', 10 * N, function(n)
+    local f = c.bench_noerrno
+    for i = 1, n do
+        f(i, 1)
+    end
+end)
+
+ffi.cdef 'int32_t bench_stats(int32_t, int32_t) __asm__("add_i32");'
+
+bench('calls with ffi.stats', 10 * N, function(n)
+    ffi.stats(true)
+    local f = c.bench_stats
+    ffi.stats(false)
+    for i = 1, n do
+        f(i, 1)
+    end
+end)
+
+ffi.cdef [[
+struct vec2 { float x, y; };
+struct vec2 add_vec2(struct vec2 a, struct vec2 b);
+void add_vec2_ptr(struct vec2* r, const struct vec2* a, const struct vec2* b);
+]]
+
+if ffi.arch == 'x64' then
+    bench('struct by value', 10 * N, function(n)
+        local f = c.add_vec2
+        local a, b = ffi.new('struct vec2', 1, 2), ffi.new('struct vec2', 3, 4)
+        for i = 1, n do
+            f(a, b)
+        end
+    end)
+end
+
+bench('struct by pointer', 10 * N, function(n)
+    local f = c.add_vec2_ptr
+    local a, b = ffi.new('struct vec2', 1, 2), ffi.new('struct vec2', 3, 4)
+    for i = 1, n do
+        f(ffi.new('struct vec2'), a, b)
+    end
+end)
+
+bench('ffi.new type string', 10 * N, function(n)
+    for i = 1, n do
+        ffi.new('uint8_t[?]', 64)
+    end
+end)
+
+bench('ffi.new ctype', 10 * N, function(n)
+    local ct = ffi.typeof('uint8_t[?]')
+    for i = 1, n do
+        ffi.new(ct, 64)
+    end
+end)
+
+bench('ffi.new 1k buffer', 10 * N, function(n)
+    local ct = ffi.typeof('uint8_t[1024]')
+    for i = 1, n do
+        ffi.new(ct)
+    end
+end)
+
+bench('arena:new 1k buffer', 10 * N, function(n)
+    local ct = ffi.typeof('uint8_t[1024]')
+    local a = ffi.arena(64 * 1024)
+    for i = 1, n do
+        if i % 64 == 0 then a:reset() end
+        a:new(ct)
+    end
+end)
+
+bench('ffi.new small struct', 10 * N, function(n)
+    local ct = ffi.typeof('struct { double x, y; }')
+    for i = 1, n do
+        ffi.new(ct)
+    end
+end)
+
+bench('arena:new small struct', 10 * N, function(n)
+    local ct = ffi.typeof('struct { double x, y; }')
+    local a = ffi.arena(64 * 1024)
+    for i = 1, n do
+        if i % 4096 == 0 then a:reset() end
+        a:new(ct)
+    end
+end)
+
+bench('ffi.new 1MB buffer', N / 10, function(n)
+    for i = 1, n do
+        ffi.new('uint8_t[?]', 1024 * 1024)
+    end
+end)
+
+bench('ffi.alloc 1MB buffer', N / 10, function(n)
+    for i = 1, n do
+        ffi.alloc('uint8_t[?]', 1024 * 1024)
+    end
+end)
+
+bench('ffi.new 16MB array', N / 100, function(n)
+    for i = 1, n do
+        ffi.new('double[?]', 2 * 1024 * 1024)
+    end
+end)
+
+bench('ffi.new 16MB largealloc', N / 100, function(n)
+    ffi.largealloc(1024 * 1024)
+    for i = 1, n do
+        ffi.new('double[?]', 2 * 1024 * 1024)
+    end
+    ffi.largealloc(nil)
+end)
+
+bench('struct field reads', 100 * N, function(n)
+    local s = ffi.new('struct vec2', 1, 2)
+    local x = 0
+    for i = 1, n do
+        x = x + s.x
+    end
+end)
+
+bench('struct field writes', 100 * N, function(n)
+    local s = ffi.new('struct vec2', 1, 2)
+    for i = 1, n do
+        s.x = i
+    end
+end)
+
+-- times a full collection of n cdata made by alloc
+local function bench_gc(name, n, alloc)
+    collectgarbage()
+    collectgarbage('stop')
+    for i = 1, n do
+        alloc(i)
+    end
+    local start = os.clock()
+    collectgarbage()
+    local t = os.clock() - start
+    collectgarbage('restart')
+    print(string.format('%-24s %8d %10.3f ms %10.3f us/op', name, n, t * 1e3, t * 1e6 / n))
+end
+
+bench_gc('collect cdata', 100 * N, function(i)
+    ffi.new('int', i)
+end)
+
+local function noop() end
+
+bench_gc('collect ffi.gc cdata', 100 * N, function(i)
+    ffi.gc(ffi.new('int', i), noop)
+end)
+
+ffi.cdef 'double bench_add_d(double, double) __asm__("add_d") __attribute__((noerrno));'
+
+do
+    local a, b, r = ffi.new('double[?]', N), ffi.new('double[?]', N), ffi.new('double[?]', N)
+    for i = 0, N - 1 do
+        a[i], b[i] = i, 2 * i
+    end
+
+    bench('array calls in lua', 10 * N, function(n)
+        local f = c.bench_add_d
+        for j = 1, n / N do
+            for i = 0, N - 1 do
+                r[i] = f(a[i], b[i])
+            end
+        end
+    end)
+
+    bench('array calls with ffi.map', 10 * N, function(n)
+        local f = c.bench_add_d
+        for j = 1, n / N do
+            ffi.map(f, N, r, a, b)
+        end
+    end)
+end
+
+ffi.cdef 'void qsort(void* base, size_t num, size_t size, int (*cmp)(const int32_t*, const int32_t*));'
+
+do
+    local arr = ffi.new('int32_t[?]', N)
+    local calls = 0
+    local cmp = ffi.cast('int (*)(const int32_t*, const int32_t*)', function(a, b)
+        calls = calls + 1
+        return a[0] - b[0]
+    end)
+    local function sort()
+        for i = 0, N - 1 do
+            arr[i] = (i * 7919) % N
+        end
+        ffi.C.qsort(arr, N, 4, cmp)
+    end
+
+    -- count the comparisons so that the time is per callback, the collector
+    -- is stopped as otherwise it dominates freeing the pointer cdatas
+    sort()
+    bench('qsort callbacks', calls, function(n)
+        collectgarbage('stop')
+        sort()
+        collectgarbage('restart')
+    end)
+    cmp:free()
+end
+
+-- os.clock adds up the cpu time of all threads so the async calls are timed
+-- with the wall clock
+local wall_clock
+
+if ffi.os == 'Windows' then
+    ffi.cdef [[
+    int QueryPerformanceCounter(int64_t* count);
+    int QueryPerformanceFrequency(int64_t* freq);
+    ]]
+    local k32 = ffi.load('kernel32')
+    local count, freq = ffi.new('int64_t[1]'), ffi.new('int64_t[1]')
+    k32.QueryPerformanceFrequency(freq)
+    wall_clock = function()
+        k32.QueryPerformanceCounter(count)
+        return tonumber(count[0]) / tonumber(freq[0])
+    end
+else
+    ffi.cdef [[
+    struct bench_timespec { long sec; long nsec; };
+    int clock_gettime(int clock, struct bench_timespec* ts);
+    ]]
+    local ts = ffi.new('struct bench_timespec')
+    wall_clock = function()
+        ffi.C.clock_gettime(0, ts) -- CLOCK_REALTIME
+        return tonumber(ts.sec) + tonumber(ts.nsec) * 1e-9
+    end
+end
+
+local function bench_wall(name, n, f)
+    collectgarbage()
+    local start = wall_clock()
+    f(n)
+    local t = wall_clock() - start
+    print(string.format('%-24s %8d %10.3f ms %10.3f us/op', name, n, t * 1e3, t * 1e6 / n))
+end
+
+ffi.cdef 'uint64_t spin(uint32_t n);'
+
+bench_wall('blocking calls', 256, function(n)
+    for i = 1, n do
+        c.spin(1000000)
+    end
+end)
+
+bench_wall('blocking calls with async', 256, function(n)
+    local h = {}
+    for i = 1, n do
+        h[i] = ffi.async(c.spin, 1000000)
+    end
+    for i = 1, n do
+        h[i]:wait()
+    end
+end)
@@ -0,0 +1,1183 @@
+/* vim: ts=4 sw=4 sts=4 et tw=78
+ * Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+ */
+#include "ffi.h"
+#include <stdio.h>
+
+/* The cdef cache saves what each ffi.cdef added to the type tables (types,
+ * functions, constants, asmname) to a file in the cache directory. The file
+ * is named after a hash of the text of all of the cdefs so far, so a later
+ * run that does the same sequence of cdefs can load the changes instead of
+ * parsing.
+ *
+ * Each file only holds the changes from one cdef and refers to the tables and
+ * ctypes from earlier cdefs by id. Ids are handed out in the order values are
+ * written, which is also the order they are read back in, so a process that
+ * loaded or saved the same chain of files numbers everything the same way.
+ * Each file records a hash of the file before it so that a file is only used
+ * on top of the one it was saved after.
+ *
+ * Loading merges into the existing tables. Records that are defined by a
+ * cached cdef are filled in the same as when parsing, so ctypes and cdatas
+ * created earlier keep working. ffi.metatype attaches lua values to the types
+ * that can't be saved, so after that the cache is no longer used. Nor is it if
+ * a cdef is done before the cache directory is set.
+ */
+
+int cachedir_key;
+int cache_state_key;
+
+#define CACHE_MAGIC "luaffi cdef cache 3\n"
+
+enum {
+    TAG_FALSE,
+    TAG_TRUE,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_LIGHT,
+    TAG_REF,
+    TAG_TABLE,
+    TAG_CTYPE,
+    TAG_CDATA,
+    TAG_UPDATE,
+    TAG_MERGE,
+    TAG_END,
+};
+
+/* light userdata that are used as table keys, to_define is rebuilt when
+ * loading and isn't saved */
+static int* light_keys[] = {
+    &g_name_key,
+    &g_front_name_key,
+    &g_back_name_key,
+};
+
+#define NUM_LIGHT_KEYS (sizeof(light_keys) / sizeof(light_keys[0]))
+
+static int* root_keys[] = {
+    &types_key,
+    &functions_key,
+    &constants_key,
+    &asmname_key,
+};
+
+#define NUM_ROOTS (sizeof(root_keys) / sizeof(root_keys[0]))
+
+/* indices into the cache state table */
+enum {
+    STATE_IDS = 1, /* weak keyed value -> id */
+    STATE_OBJS, /* weak valued id -> value */
+    STATE_BYTES, /* weak keyed root ctype -> its bytes when last saved */
+    STATE_SHADOW, /* copies of the root tables when last saved */
+};
+
+#if defined ARCH_X86
+#define CACHE_ARCH "x86"
+#elif defined ARCH_X64
+#define CACHE_ARCH "x64"
+#elif defined ARCH_ARM
+#define CACHE_ARCH "arm"
+#else
+#define CACHE_ARCH "unknown"
+#endif
+
+#if defined OS_WIN || defined OS_CE
+#define CACHE_OS "windows"
+#elif defined OS_OSX
+#define CACHE_OS "osx"
+#else
+#define CACHE_OS "posix"
+#endif
+
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t sz)
+{
+    const uint8_t* u = (const uint8_t*) p;
+    size_t i;
+    for (i = 0; i < sz; i++) {
+        h = (h ^ u[i]) * UINT64_C(0x100000001B3);
+    }
+    return h;
+}
+
+/* update_cdef_hash adds the text of a cdef to the running hash used to name
+ * the cache files */
+static void update_cdef_hash(struct jit* jit, const char* text, size_t sz)
+{
+    if (jit->cdef_hash == 0) {
+        /* tie the cache to this build and abi */
+        static const int build[] = {
+            LUA_VERSION_NUM,
+            (int) sizeof(struct ctype),
+            (int) sizeof(struct cdata),
+            (int) sizeof(void*),
+        };
+        jit->cdef_hash = hash_bytes(UINT64_C(0xCBF29CE484222325), CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1);
+        jit->cdef_hash = hash_bytes(jit->cdef_hash, build, sizeof(build));
+        jit->cdef_hash = hash_bytes(jit->cdef_hash, CACHE_ARCH CACHE_OS, sizeof(CACHE_ARCH CACHE_OS) - 1);
+    }
+
+    jit->cdef_hash = hash_bytes(jit->cdef_hash, &sz, sizeof(sz));
+    jit->cdef_hash = hash_bytes(jit->cdef_hash, text, sz);
+}
+
+/* pushes the filename of the cache file for the current hash, or returns 0
+ * if caching is off */
+static int push_cache_file(lua_State* L, struct jit* jit)
+{
+    char buf[32];
+
+    if (jit->cdef_cache_off) {
+        return 0;
+    }
+
+    push_upval(L, &cachedir_key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    sprintf(buf, "%08x%08x", (unsigned) (jit->cdef_hash >> 32), (unsigned) jit->cdef_hash);
+    lua_pushfstring(L, "%s/%s.cdef", lua_tostring(L, -1), buf);
+    lua_remove(L, -2);
+    return 1;
+}
+
+static void push_state(lua_State* L, int field)
+{
+    push_upval(L, &cache_state_key);
+    lua_rawgeti(L, -1, field);
+    lua_remove(L, -2);
+}
+
+static int is_ctype(lua_State* L, int idx)
+{
+    int ret = 0;
+    if (lua_type(L, idx) == LUA_TUSERDATA && lua_getmetatable(L, idx)) {
+        ret = is_metatable(L, -1, &ctype_mt_key);
+        lua_pop(L, 1);
+    }
+    return ret;
+}
+
+/* records the root ctype at idx as saved */
+static void set_saved_bytes(lua_State* L, int bytes, int idx)
+{
+    if (is_ctype(L, idx)) {
+        lua_pushvalue(L, idx);
+        lua_pushlstring(L, (const char*) lua_touserdata(L, idx), sizeof(struct ctype));
+        lua_rawset(L, bytes);
+    }
+}
+
+static void push_weak_table(lua_State* L, const char* mode)
+{
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, mode);
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+}
+
+/* Numbering the types there before the first cdef */
+
+struct numbering {
+    int ids;
+    int objs;
+    int next_id;
+    uint64_t hash;
+};
+
+static int light_key_index(void* p)
+{
+    size_t i;
+    for (i = 0; i < NUM_LIGHT_KEYS; i++) {
+        if (p == light_keys[i]) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/* orders table keys in the same way in every process, unlike lua_next */
+static int key_less(lua_State* L, int a, int b)
+{
+    size_t asz, bsz;
+    const char *astr, *bstr;
+    int cmp;
+
+    if (lua_type(L, a) != lua_type(L, b)) {
+        return lua_type(L, a) < lua_type(L, b);
+    }
+
+    switch (lua_type(L, a)) {
+    case LUA_TNUMBER:
+        return lua_tonumber(L, a) < lua_tonumber(L, b);
+    case LUA_TBOOLEAN:
+        return lua_toboolean(L, a) < lua_toboolean(L, b);
+    case LUA_TLIGHTUSERDATA:
+        return light_key_index(lua_touserdata(L, a)) < light_key_index(lua_touserdata(L, b));
+    case LUA_TSTRING:
+        astr = lua_tolstring(L, a, &asz);
+        bstr = lua_tolstring(L, b, &bsz);
+        cmp = memcmp(astr, bstr, asz < bsz ? asz : bsz);
+        return cmp < 0 || (cmp == 0 && asz < bsz);
+    default:
+        return 0;
+    }
+}
+
+static void hash_key(lua_State* L, struct numbering* N, int idx)
+{
+    size_t sz;
+    const char* str;
+    lua_Number num;
+    int light;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNUMBER:
+        num = lua_tonumber(L, idx);
+        N->hash = hash_bytes(N->hash, &num, sizeof(num));
+        break;
+    case LUA_TSTRING:
+        str = lua_tolstring(L, idx, &sz);
+        N->hash = hash_bytes(N->hash, &sz, sizeof(sz));
+        N->hash = hash_bytes(N->hash, str, sz);
+        break;
+    case LUA_TLIGHTUSERDATA:
+        light = light_key_index(lua_touserdata(L, idx));
+        N->hash = hash_bytes(N->hash, &light, sizeof(light));
+        break;
+    }
+}
+
+/* number_value gives ids to the table or userdata at idx and everything
+ * reachable from it */
+static void number_value(lua_State* L, struct numbering* N, int idx)
+{
+    int i, j, n, keys;
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 8, "cdef cache too deep");
+
+    if (lua_type(L, idx) != LUA_TTABLE && lua_type(L, idx) != LUA_TUSERDATA) {
+        return;
+    }
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, N->ids);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, idx);
+    lua_pushnumber(L, N->next_id);
+    lua_rawset(L, N->ids);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, N->objs, N->next_id++);
+
+    if (lua_type(L, idx) == LUA_TUSERDATA) {
+        lua_getuservalue(L, idx);
+        number_value(L, N, -1);
+        lua_pop(L, 1);
+        return;
+    }
+
+    /* sort the keys with an insertion sort, the tables before the first
+     * cdef are small */
+    lua_newtable(L);
+    keys = lua_gettop(L);
+    n = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) == LUA_TLIGHTUSERDATA && light_key_index(lua_touserdata(L, -1)) < 0) {
+            continue;
+        }
+
+        for (j = n; j > 0; j--) {
+            lua_rawgeti(L, keys, j);
+            if (!key_less(L, -2, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            lua_rawseti(L, keys, j + 1);
+        }
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, keys, j + 1);
+        n++;
+    }
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, keys, i);
+        hash_key(L, N, -1);
+        number_value(L, N, -1);
+        lua_rawget(L, idx);
+        number_value(L, N, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1); /* keys */
+}
+
+/* start_cache is called for the first cdef. It numbers all of the existing
+ * types and takes a copy of the root tables to compare against when saving
+ * the first cache file. */
+static void start_cache(lua_State* L, struct jit* jit)
+{
+    struct numbering N;
+    size_t r;
+    int top = lua_gettop(L);
+
+    lua_newtable(L);
+    push_weak_table(L, "k");
+    lua_rawseti(L, -2, STATE_IDS);
+    push_weak_table(L, "v");
+    lua_rawseti(L, -2, STATE_OBJS);
+    push_weak_table(L, "k");
+    lua_rawseti(L, -2, STATE_BYTES);
+
+    lua_rawgeti(L, top + 1, STATE_IDS);
+    lua_rawgeti(L, top + 1, STATE_OBJS);
+    lua_rawgeti(L, top + 1, STATE_BYTES);
+    N.ids = top + 2;
+    N.objs = top + 3;
+    N.next_id = 0;
+    N.hash = jit->cdef_hash;
+
+    for (r = 0; r < NUM_ROOTS; r++) {
+        push_upval(L, root_keys[r]);
+        number_value(L, &N, -1);
+
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, -3)) {
+            set_saved_bytes(L, top + 4, -1);
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+        lua_rawseti(L, top + 1, (int) (STATE_SHADOW + r));
+        lua_pop(L, 1);
+    }
+
+    jit->cdef_next_id = N.next_id;
+    jit->cdef_token = N.hash;
+
+    lua_settop(L, top + 1);
+    set_upval(L, &cache_state_key);
+}
+
+/* Saving */
+
+struct writer {
+    FILE* f;
+    uint64_t hash;
+    int ids; /* stack index of value -> id of values in earlier files */
+    int new_ids; /* value -> id of values first written in this file */
+    int merged; /* tables from earlier files written with TAG_MERGE */
+    int next_id;
+};
+
+static void write_bytes(struct writer* W, const void* p, size_t sz)
+{
+    W->hash = hash_bytes(W->hash, p, sz);
+    fwrite(p, 1, sz, W->f);
+}
+
+static void write_tag(struct writer* W, uint8_t tag)
+{ write_bytes(W, &tag, 1); }
+
+static void write_size(struct writer* W, size_t sz)
+{
+    uint32_t u = (uint32_t) sz;
+    write_bytes(W, &u, sizeof(u));
+}
+
+/* returns the id of the table or userdata at idx, or -1 if it hasn't been
+ * written yet */
+static int get_id(lua_State* L, int ids, int idx)
+{
+    int id = -1;
+    lua_pushvalue(L, idx);
+    lua_rawget(L, ids);
+    if (!lua_isnil(L, -1)) {
+        id = (int) lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+    return id;
+}
+
+static int write_value(lua_State* L, struct writer* W, int idx);
+
+/* writes out the contents of the table at idx followed by TAG_END */
+static int write_entries(lua_State* L, struct writer* W, int idx)
+{
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        if (lua_type(L, -2) == LUA_TLIGHTUSERDATA && lua_touserdata(L, -2) == &to_define_key) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        if (!write_value(L, W, -2) || !write_value(L, W, -1)) {
+            lua_pop(L, 2);
+            return 0;
+        }
+        lua_pop(L, 1);
+    }
+
+    write_tag(W, TAG_END);
+    return 1;
+}
+
+/* writes out the user value of the userdata at idx or TAG_END for none. A
+ * table from an earlier file is written in full with TAG_MERGE if merge is
+ * set. */
+static int write_uservalue(lua_State* L, struct writer* W, int idx, int merge)
+{
+    int id, ret = 1;
+
+    lua_getuservalue(L, idx);
+#if LUA_VERSION_NUM == 501
+    if (equals_upval(L, -1, &niluv_key)) {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+#endif
+
+    if (lua_isnil(L, -1)) {
+        write_tag(W, TAG_END);
+
+    } else if (merge && lua_istable(L, -1) && (id = get_id(L, W->ids, -1)) >= 0 && get_id(L, W->merged, -1) < 0) {
+        lua_pushvalue(L, -1);
+        lua_pushnumber(L, id);
+        lua_rawset(L, W->merged);
+
+        write_tag(W, TAG_MERGE);
+        write_size(W, id);
+        ret = write_entries(L, W, lua_gettop(L));
+
+    } else {
+        ret = write_value(L, W, -1);
+    }
+
+    lua_pop(L, 1);
+    return ret;
+}
+
+/* write_value writes out the value at idx, returning 0 if it can't be
+ * saved */
+static int write_value(lua_State* L, struct writer* W, int idx)
+{
+    size_t sz;
+    const char* str;
+    lua_Number num;
+    void* p;
+    int id;
+
+    idx = lua_absindex(L, idx);
+    luaL_checkstack(L, 8, "cdef cache too deep");
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        write_tag(W, lua_toboolean(L, idx) ? TAG_TRUE : TAG_FALSE);
+        return 1;
+
+    case LUA_TNUMBER:
+        num = lua_tonumber(L, idx);
+        write_tag(W, TAG_NUMBER);
+        write_bytes(W, &num, sizeof(num));
+        return 1;
+
+    case LUA_TSTRING:
+        str = lua_tolstring(L, idx, &sz);
+        write_tag(W, TAG_STRING);
+        write_size(W, sz);
+        write_bytes(W, str, sz);
+        return 1;
+
+    case LUA_TLIGHTUSERDATA:
+        id = light_key_index(lua_touserdata(L, idx));
+        if (id < 0) {
+            return 0;
+        }
+        write_tag(W, TAG_LIGHT);
+        write_size(W, id);
+        return 1;
+
+    case LUA_TTABLE:
+    case LUA_TUSERDATA:
+        break;
+
+    default:
+        return 0;
+    }
+
+    /* tables and userdata are written out once and then referred to by id */
+    if ((id = get_id(L, W->ids, idx)) >= 0 || (id = get_id(L, W->new_ids, idx)) >= 0) {
+        write_tag(W, TAG_REF);
+        write_size(W, id);
+        return 1;
+    }
+
+    lua_pushvalue(L, idx);
+    lua_pushnumber(L, W->next_id++);
+    lua_rawset(L, W->new_ids);
+
+    if (lua_type(L, idx) == LUA_TTABLE) {
+        /* tables with metatables are the to_define tables, which are skipped,
+         * or have come from ffi.metatype */
+        if (lua_getmetatable(L, idx)) {
+            lua_pop(L, 1);
+            return 0;
+        }
+
+        write_tag(W, TAG_TABLE);
+        return write_entries(L, W, idx);
+    }
+
+    /* userdata, only ctypes and cdatas can be saved */
+    p = lua_touserdata(L, idx);
+    sz = lua_rawlen(L, idx);
+
+    if (!lua_getmetatable(L, idx)) {
+        return 0;
+    } else if (is_metatable(L, -1, &ctype_mt_key)) {
+        write_tag(W, TAG_CTYPE);
+    } else if (is_metatable(L, -1, &cdata_mt_key)) {
+        struct cdata* cd = (struct cdata*) p;
+        /* pointers other than NULL are only valid for this process */
+        if ((cd->type.pointers || cd->type.type == FUNCTION_PTR_TYPE || cd->type.type == INTPTR_TYPE)
+                && (sz < sizeof(struct cdata) + sizeof(void*) || *(void**) (cd+1) != NULL)) {
+            lua_pop(L, 1);
+            return 0;
+        }
+        write_tag(W, TAG_CDATA);
+    } else {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+
+    write_size(W, sz);
+    write_bytes(W, p, sz);
+    return write_uservalue(L, W, idx, 0);
+}
+
+/* write_roots writes the entries of the root tables that have changed since
+ * they were last saved. Changed keys are added to the tables at changed. */
+static int write_roots(lua_State* L, struct writer* W, int shadows, int bytes, int changed)
+{
+    size_t r;
+    int root, shadow, id;
+
+    for (r = 0; r < NUM_ROOTS; r++) {
+        push_upval(L, root_keys[r]);
+        root = lua_gettop(L);
+        lua_rawgeti(L, shadows, (int) (STATE_SHADOW + r));
+        shadow = lua_gettop(L);
+        lua_rawgeti(L, changed, (int) r + 1);
+
+        lua_pushnil(L);
+        while (lua_next(L, root)) {
+            int update = 0;
+
+            lua_pushvalue(L, -2);
+            lua_rawget(L, shadow);
+            if (!lua_rawequal(L, -1, -2)) {
+                lua_pop(L, 1);
+            } else if (is_ctype(L, -1)) {
+                /* a record defined by this cdef updates the ctypes that were
+                 * waiting on it */
+                lua_rawget(L, bytes);
+                if (lua_isnil(L, -1) || memcmp(lua_tostring(L, -1), lua_touserdata(L, -2), sizeof(struct ctype)) == 0) {
+                    lua_pop(L, 2);
+                    continue;
+                }
+                lua_pop(L, 1);
+                update = 1;
+            } else {
+                lua_pop(L, 2);
+                continue;
+            }
+
+            lua_pushvalue(L, -2);
+            lua_pushboolean(L, 1);
+            lua_rawset(L, shadow + 1);
+
+            if (!write_value(L, W, -2)) {
+                return 0;
+            }
+
+            if (update && (id = get_id(L, W->ids, -1)) >= 0) {
+                write_tag(W, TAG_UPDATE);
+                write_size(W, id);
+                write_bytes(W, lua_touserdata(L, -1), sizeof(struct ctype));
+                if (!write_uservalue(L, W, lua_gettop(L), 1)) {
+                    return 0;
+                }
+            } else if (!write_value(L, W, -1)) {
+                return 0;
+            }
+
+            lua_pop(L, 1);
+        }
+
+        write_tag(W, TAG_END);
+        lua_settop(L, root - 1);
+    }
+
+    push_upval(L, &next_unnamed_key);
+    return write_value(L, W, -1);
+}
+
+/* saved_cache updates the cache state after a file has been saved */
+static void saved_cache(lua_State* L, struct writer* W, int shadows, int bytes, int changed)
+{
+    size_t r;
+    int objs;
+
+    push_state(L, STATE_OBJS);
+    objs = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, W->new_ids)) {
+        lua_pushvalue(L, -2);
+        lua_rawseti(L, objs, (int) lua_tonumber(L, -2));
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, W->ids);
+    }
+    lua_pop(L, 1);
+
+    for (r = 0; r < NUM_ROOTS; r++) {
+        push_upval(L, root_keys[r]);
+        lua_rawgeti(L, shadows, (int) (STATE_SHADOW + r));
+        lua_rawgeti(L, changed, (int) r + 1);
+
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -6);
+            set_saved_bytes(L, bytes, -1);
+            lua_rawset(L, -5);
+        }
+
+        lua_pop(L, 3);
+    }
+}
+
+static void save_cdef_cache(lua_State* L, struct jit* jit)
+{
+    struct writer W;
+    const char* file;
+    int top = lua_gettop(L);
+    int shadows, bytes, changed;
+    int ok = 0;
+    size_t r;
+
+    if (!push_cache_file(L, jit)) {
+        return;
+    }
+
+    file = lua_tostring(L, -1);
+
+    /* write to a temporary and rename so that other processes never see a
+     * partial file */
+    lua_pushfstring(L, "%s.tmp", file);
+    W.f = fopen(lua_tostring(L, -1), "wb");
+
+    if (W.f != NULL) {
+        push_upval(L, &cache_state_key);
+        shadows = lua_gettop(L);
+        push_state(L, STATE_IDS);
+        W.ids = lua_gettop(L);
+        push_state(L, STATE_BYTES);
+        bytes = lua_gettop(L);
+        lua_newtable(L);
+        W.new_ids = lua_gettop(L);
+        lua_newtable(L);
+        W.merged = lua_gettop(L);
+        lua_newtable(L);
+        changed = lua_gettop(L);
+        for (r = 0; r < NUM_ROOTS; r++) {
+            lua_newtable(L);
+            lua_rawseti(L, changed, (int) r + 1);
+        }
+
+        W.next_id = jit->cdef_next_id;
+
+        fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, W.f);
+        fwrite(&jit->cdef_token, 1, sizeof(jit->cdef_token), W.f);
+
+        /* the file ends with a hash of the contents and the file it follows,
+         * which identifies the file to the next one */
+        W.hash = jit->cdef_token;
+        ok = write_roots(L, &W, shadows, bytes, changed);
+        lua_settop(L, changed);
+        fwrite(&W.hash, 1, sizeof(W.hash), W.f);
+
+        ok = !ferror(W.f) && fclose(W.f) == 0 && ok;
+        ok = ok && rename(lua_tostring(L, top + 2), file) == 0;
+
+        if (ok) {
+            saved_cache(L, &W, shadows, bytes, changed);
+            jit->cdef_next_id = W.next_id;
+            jit->cdef_token = W.hash;
+        } else {
+            remove(lua_tostring(L, top + 2));
+        }
+    }
+
+    /* later files can't be saved without this one */
+    if (!ok) {
+        jit->cdef_cache_off = 1;
+    }
+
+    lua_settop(L, top);
+}
+
+/* Loading */
+
+struct reader {
+    const uint8_t* p;
+    const uint8_t* end;
+    int objs; /* stack index of id -> value of values in earlier files */
+    int new_objs; /* id -> value of values first read from this file */
+    int first_id;
+    int next_id;
+    int todo; /* changes to existing values, made once the file is read */
+    int todonum;
+};
+
+static int read_bytes(struct reader* R, void* p, size_t sz)
+{
+    if ((size_t) (R->end - R->p) < sz) {
+        return 0;
+    }
+    memcpy(p, R->p, sz);
+    R->p += sz;
+    return 1;
+}
+
+static int read_size(struct reader* R, size_t* sz)
+{
+    uint32_t u;
+    if (!read_bytes(R, &u, sizeof(u))) {
+        return 0;
+    }
+    *sz = u;
+    return 1;
+}
+
+/* pushes the value with the given id, or returns 0 */
+static int push_id(lua_State* L, struct reader* R, size_t id)
+{
+    if (id >= (size_t) R->next_id) {
+        return 0;
+    }
+    lua_rawgeti(L, id < (size_t) R->first_id ? R->objs : R->new_objs, (int) id);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    return 1;
+}
+
+/* adds {tag, values...} with the top n values to the todo list */
+static void add_todo(lua_State* L, struct reader* R, int tag, int n)
+{
+    int i;
+    lua_createtable(L, n + 1, 0);
+    lua_pushnumber(L, tag);
+    lua_rawseti(L, -2, 1);
+    for (i = 0; i < n; i++) {
+        lua_pushvalue(L, -n - 1 + i);
+        lua_rawseti(L, -2, i + 2);
+    }
+    lua_rawseti(L, R->todo, ++R->todonum);
+}
+
+static int read_value(lua_State* L, struct reader* R, int* end);
+
+/* reads entries into the table on the top of the stack up to a TAG_END */
+static int read_entries(lua_State* L, struct reader* R)
+{
+    int end;
+    for (;;) {
+        if (!read_value(L, R, &end)) {
+            return 0;
+        } else if (end) {
+            return 1;
+        } else if (!read_value(L, R, &end) || end) {
+            return 0;
+        }
+        lua_rawset(L, -3);
+    }
+}
+
+/* read_value pushes the next value, or returns 0 if the file is corrupt.
+ * TAG_END pushes nothing and sets *end. */
+static int read_value(lua_State* L, struct reader* R, int* end)
+{
+    uint8_t tag;
+    size_t sz, id;
+    lua_Number num;
+    void* p;
+
+    luaL_checkstack(L, 8, "cdef cache too deep");
+    *end = 0;
+
+    if (!read_bytes(R, &tag, 1)) {
+        return 0;
+    }
+
+    switch (tag) {
+    case TAG_FALSE:
+    case TAG_TRUE:
+        lua_pushboolean(L, tag == TAG_TRUE);
+        return 1;
+
+    case TAG_NUMBER:
+        if (!read_bytes(R, &num, sizeof(num))) {
+            return 0;
+        }
+        lua_pushnumber(L, num);
+        return 1;
+
+    case TAG_STRING:
+        if (!read_size(R, &sz) || (size_t) (R->end - R->p) < sz) {
+            return 0;
+        }
+        lua_pushlstring(L, (const char*) R->p, sz);
+        R->p += sz;
+        return 1;
+
+    case TAG_LIGHT:
+        if (!read_size(R, &sz) || sz >= NUM_LIGHT_KEYS) {
+            return 0;
+        }
+        lua_pushlightuserdata(L, light_keys[sz]);
+        return 1;
+
+    case TAG_REF:
+        return read_size(R, &id) && push_id(L, R, id);
+
+    case TAG_END:
+        *end = 1;
+        return 1;
+
+    case TAG_TABLE:
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, R->new_objs, R->next_id++);
+        return read_entries(L, R);
+
+    case TAG_MERGE:
+        /* more entries for a table from an earlier file */
+        if (!read_size(R, &id) || id >= (size_t) R->first_id || !push_id(L, R, id) || !lua_istable(L, -1)) {
+            return 0;
+        }
+        lua_newtable(L);
+        if (!read_entries(L, R)) {
+            return 0;
+        }
+        add_todo(L, R, TAG_MERGE, 2);
+        lua_pop(L, 1);
+        return 1;
+
+    case TAG_UPDATE:
+        /* new contents for a ctype from an earlier file */
+        if (!read_size(R, &id) || id >= (size_t) R->first_id || !push_id(L, R, id) || !is_ctype(L, -1)
+                || (size_t) (R->end - R->p) < sizeof(struct ctype)) {
+            return 0;
+        }
+        lua_pushlstring(L, (const char*) R->p, sizeof(struct ctype));
+        R->p += sizeof(struct ctype);
+
+        if (!read_value(L, R, end)) {
+            return 0;
+        } else if (*end) {
+            *end = 0;
+            lua_pushnil(L);
+        }
+
+        add_todo(L, R, TAG_UPDATE, 3);
+        lua_pop(L, 2);
+        return 1;
+
+    case TAG_CTYPE:
+    case TAG_CDATA:
+        if (!read_size(R, &sz)
+                || sz < sizeof(struct ctype)
+                || (tag == TAG_CTYPE && sz != sizeof(struct ctype))
+                || (tag == TAG_CDATA && sz < sizeof(struct cdata))) {
+            return 0;
+        }
+
+        p = lua_newuserdata(L, sz);
+        if (!read_bytes(R, p, sz)) {
+            return 0;
+        }
+
+        push_upval(L, tag == TAG_CTYPE ? &ctype_mt_key : &cdata_mt_key);
+        lua_setmetatable(L, -2);
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, R->new_objs, R->next_id++);
+
+        if (!read_value(L, R, end)) {
+            return 0;
+        } else if (*end) {
+            *end = 0;
+#if LUA_VERSION_NUM == 501
+            push_upval(L, &niluv_key);
+            lua_setfenv(L, -2);
+#endif
+        } else if (!lua_istable(L, -1)) {
+            return 0;
+        } else {
+            /* undefined types have to be in the to_define table of their
+             * record, as push_ctype does */
+            if (!((struct ctype*) p)->is_defined) {
+                add_todo(L, R, TAG_CTYPE, 2);
+            }
+            lua_setuservalue(L, -2);
+        }
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/* apply_todo makes the changes to existing values with the given tag */
+static void apply_todo(lua_State* L, struct reader* R, int tag)
+{
+    int i;
+
+    for (i = 1; i <= R->todonum; i++) {
+        lua_rawgeti(L, R->todo, i);
+        lua_rawgeti(L, -1, 1);
+        if ((int) lua_tonumber(L, -1) != tag) {
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_pop(L, 1);
+
+        lua_rawgeti(L, -1, 2);
+        lua_rawgeti(L, -2, 3);
+
+        if (tag == TAG_MERGE) {
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, -5);
+            }
+
+        } else if (tag == TAG_CTYPE) {
+            update_on_definition(L, -1, -2);
+
+        } else {
+            struct ctype* ct = (struct ctype*) lua_touserdata(L, -2);
+            struct ctype def;
+            memcpy(&def, lua_tostring(L, -1), sizeof(def));
+
+            lua_rawgeti(L, -3, 4);
+            if (def.is_defined && !ct->is_defined && lua_istable(L, -1)) {
+                set_defined(L, -1, &def);
+            }
+            lua_pop(L, 1);
+
+            memcpy(ct, lua_tostring(L, -1), sizeof(*ct));
+        }
+
+        lua_pop(L, 3);
+    }
+}
+
+static int load_cdef_cache(lua_State* L, struct jit* jit)
+{
+    struct reader R;
+    FILE* f;
+    long sz;
+    uint8_t* data;
+    uint64_t parent, hash;
+    size_t r;
+    int top = lua_gettop(L);
+    int ok = 1, end, state, bytes, roots;
+
+    if (!push_cache_file(L, jit)) {
+        return 0;
+    }
+
+    f = fopen(lua_tostring(L, -1), "rb");
+    lua_pop(L, 1);
+    if (f == NULL) {
+        return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = sz > 0 ? (uint8_t*) malloc(sz) : NULL;
+    if (data == NULL || fread(data, 1, sz, f) != (size_t) sz) {
+        free(data);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    /* the file has to follow on from the last one loaded or saved and
+     * be complete */
+    if ((size_t) sz < sizeof(CACHE_MAGIC) - 1 + 2 * sizeof(uint64_t)
+            || memcmp(data, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1) != 0) {
+        free(data);
+        return 0;
+    }
+
+    R.p = data + sizeof(CACHE_MAGIC) - 1;
+    R.end = data + sz - sizeof(uint64_t);
+    memcpy(&parent, R.p, sizeof(parent));
+    memcpy(&hash, R.end, sizeof(hash));
+    R.p += sizeof(parent);
+
+    if (parent != jit->cdef_token || hash_bytes(parent, R.p, R.end - R.p) != hash) {
+        free(data);
+        return 0;
+    }
+
+    push_upval(L, &cache_state_key);
+    state = lua_gettop(L);
+    push_state(L, STATE_OBJS);
+    R.objs = lua_gettop(L);
+    lua_newtable(L);
+    R.new_objs = lua_gettop(L);
+    lua_newtable(L);
+    R.todo = lua_gettop(L);
+    R.todonum = 0;
+    R.first_id = R.next_id = jit->cdef_next_id;
+
+    /* the root tables aren't changed until the whole file has been read */
+    lua_newtable(L);
+    roots = lua_gettop(L);
+    for (r = 0; ok && r < NUM_ROOTS; r++) {
+        lua_newtable(L);
+        ok = read_entries(L, &R);
+        lua_rawseti(L, roots, (int) r + 1);
+    }
+
+    ok = ok && read_value(L, &R, &end) && !end && lua_isnumber(L, -1) && R.p == R.end;
+    free(data);
+
+    if (!ok) {
+        lua_settop(L, top);
+        return 0;
+    }
+
+    set_upval(L, &next_unnamed_key);
+
+    apply_todo(L, &R, TAG_MERGE);
+    apply_todo(L, &R, TAG_CTYPE);
+    apply_todo(L, &R, TAG_UPDATE);
+
+    lua_rawgeti(L, state, STATE_BYTES);
+    bytes = lua_gettop(L);
+
+    for (r = 0; r < NUM_ROOTS; r++) {
+        push_upval(L, root_keys[r]);
+        lua_rawgeti(L, state, (int) (STATE_SHADOW + r));
+        lua_rawgeti(L, roots, (int) r + 1);
+
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            set_saved_bytes(L, bytes, -1);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -6); /* shadow[key] = value */
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -6); /* root[key] = value */
+        }
+
+        lua_pop(L, 3);
+    }
+
+    lua_rawgeti(L, state, STATE_IDS);
+    for (; jit->cdef_next_id < R.next_id; jit->cdef_next_id++) {
+        lua_rawgeti(L, R.new_objs, jit->cdef_next_id);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, R.objs, jit->cdef_next_id);
+        lua_pushnumber(L, jit->cdef_next_id);
+        lua_rawset(L, -3);
+    }
+
+    jit->cdef_token = hash;
+    lua_settop(L, top);
+    return 1;
+}
+
+/* cdef_cache_begin is called before parsing the text of a cdef. It returns 1
+ * if the result was loaded from the cache and the cdef can be skipped. */
+int cdef_cache_begin(lua_State* L, const char* text, size_t sz)
+{
+    struct jit* jit = get_jit(L);
+    int first = jit->cdef_hash == 0;
+
+    /* the last cdef errored out part way through and may have left some
+     * types behind */
+    if (jit->cdef_busy) {
+        jit->cdef_cache_off = 1;
+    }
+
+    update_cdef_hash(jit, text, sz);
+
+    if (!jit->cdef_cache_off) {
+        push_upval(L, &cachedir_key);
+        if (lua_isnil(L, -1)) {
+            /* later cache files would be missing this cdef */
+            jit->cdef_cache_off = 1;
+        } else if (first) {
+            start_cache(L, jit);
+        }
+        lua_pop(L, 1);
+    }
+
+    if (load_cdef_cache(L, jit)) {
+        return 1;
+    }
+
+    jit->cdef_busy = 1;
+    return 0;
+}
+
+/* cdef_cache_end is called after successfully parsing a cdef */
+void cdef_cache_end(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+    jit->cdef_busy = 0;
+    save_cdef_cache(L, jit);
+}
+
+/* ffi.cachedir([dir]) sets the directory used for the cdef cache. nil turns
+ * off the cache. Returns the previous directory. */
+int ffi_cachedir(lua_State* L)
+{
+    lua_settop(L, 1);
+    if (!lua_isnil(L, 1)) {
+        luaL_checkstring(L, 1);
+    }
+    push_upval(L, &cachedir_key);
+    lua_pushvalue(L, 1);
+    set_upval(L, &cachedir_key);
+    return 1;
+}
+
@@ -3,10 +3,12 @@
  */
 #include "ffi.h"
 
-static cfunction compile(Dst_DECL, lua_State* L, cfunction func, int ref);
+static cfunction compile(Dst_DECL, lua_State* L, cfunction func, int ref, int kind, int ct_usr, const struct ctype* ct);
 
-static void* reserve_code(struct jit* jit, lua_State* L, size_t sz);
-static void commit_code(struct jit* jit, void* p, size_t sz);
+static void* reserve_code(struct jit* jit, lua_State* L, size_t sz, int pinned);
+static void commit_code(struct jit* jit, void* code);
+static void release_code(struct jit* jit, void* code);
+static void free_chunk_lists(struct jit* jit);
 
 static void push_int(lua_State* L, int val)
 { lua_pushnumber(L, val); }
@@ -45,51 +47,544 @@ static void SetLastError(int err)
 #include "call_x86.h"
 #endif
 
+#ifdef DOUBLE_MAP_CODE
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+/* Address space reserved for each of the two mappings. Pages are allocated
+ * within this so that the offset between the writable and executable views
+ * is the same for all pages, which keeps relative branches between pages
+ * (eg to the globals) valid.
+ */
+#if defined __amd64__
+#define CODE_REGION_SIZE ((size_t) 1 << 30)
+#else
+#define CODE_REGION_SIZE ((size_t) 1 << 25)
+#endif
+
+void init_code_pages(struct jit* jit)
+{
+    uint8_t* base = MAP_FAILED;
+    size_t sz = jit->align_page_size + 1;
+
+    /* set in the environment to use the mprotect path, eg to compare the
+     * two in bench.lua */
+    if (getenv("LUA_FFI_NO_DOUBLE_MAP")) {
+        jit->code_fd = -1;
+        jit->exec_off = 0;
+        return;
+    }
+
+    jit->code_fd = (int) syscall(SYS_memfd_create, "luaffi-jit", MFD_CLOEXEC);
+    if (jit->code_fd < 0) {
+        goto err;
+    }
+
+    base = (uint8_t*) mmap(NULL, 2 * CODE_REGION_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+
+    /* check we are actually allowed to execute from the memfd */
+    if (base == MAP_FAILED
+            || ftruncate(jit->code_fd, sz)
+            || mmap(base + CODE_REGION_SIZE, sz, PROT_READ|PROT_EXEC, MAP_SHARED|MAP_FIXED, jit->code_fd, 0) == MAP_FAILED) {
+        goto err;
+    }
+
+    jit->code_rw = base;
+    jit->code_filesz = sz;
+    jit->exec_off = CODE_REGION_SIZE;
+    return;
+
+err:
+    if (base != MAP_FAILED) {
+        munmap(base, 2 * CODE_REGION_SIZE);
+    }
+    if (jit->code_fd >= 0) {
+        close(jit->code_fd);
+    }
+    jit->code_fd = -1;
+    jit->exec_off = 0;
+}
+
+void free_code_pages(struct jit* jit)
+{
+    size_t i;
+    if (jit->exec_off) {
+        munmap(jit->code_rw, 2 * CODE_REGION_SIZE);
+        close(jit->code_fd);
+    } else {
+        for (i = 0; i < jit->pagenum; i++) {
+            FreePage(jit->pages[i], jit->pages[i]->size);
+        }
+        for (i = 0; i < jit->pinnednum; i++) {
+            FreePage(jit->pinned[i], jit->pinned[i]->size);
+        }
+    }
+    free(jit->code_free);
+    free(jit->pages);
+    free(jit->pinned);
+    free_chunk_lists(jit);
+}
+
+static struct page* alloc_page(struct jit* jit, lua_State* L, size_t size)
+{
+    size_t i, off;
+    uint8_t* rw;
+
+    if (!jit->exec_off) {
+        return (struct page*) AllocPage(size);
+    }
+
+    /* reuse the first free range that fits, these are already mapped */
+    for (i = 0; i < jit->code_freenum; i++) {
+        struct code_range* r = &jit->code_free[i];
+        if (r->size >= size) {
+            off = r->off;
+            r->off += size;
+            r->size -= size;
+            if (r->size == 0) {
+                memmove(r, r+1, (jit->code_freenum - (i+1)) * sizeof(*r));
+                jit->code_freenum--;
+            }
+            return (struct page*) (jit->code_rw + off);
+        }
+    }
+
+    off = jit->code_used;
+    if (off + size > CODE_REGION_SIZE) {
+        luaL_error(L, "out of memory for jit code");
+    }
+
+    if (off + size > jit->code_filesz) {
+        if (ftruncate(jit->code_fd, off + size)) {
+            luaL_error(L, "failed to grow jit code file");
+        }
+        jit->code_filesz = off + size;
+    }
+
+    rw = jit->code_rw + off;
+    if (mmap(rw, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, jit->code_fd, off) == MAP_FAILED
+            || mmap(rw + jit->exec_off, size, PROT_READ|PROT_EXEC, MAP_SHARED|MAP_FIXED, jit->code_fd, off) == MAP_FAILED) {
+        luaL_error(L, "failed to map jit code");
+    }
+
+    jit->code_used = off + size;
+    return (struct page*) rw;
+}
+
+static void free_page(struct jit* jit, struct page* page)
+{
+    struct code_range* r;
+    size_t i, off, size;
+
+    if (!jit->exec_off) {
+        FreePage(page, page->size);
+        return;
+    }
+
+    /* leave the range mapped for reuse, but give the memory back. Removed
+     * ranges read back as zeros. */
+    off = (uint8_t*) page - jit->code_rw;
+    size = page->size;
+    madvise(page, size, MADV_REMOVE);
+
+    /* the ranges are kept sorted so that neighbours can be merged */
+    i = 0;
+    while (i < jit->code_freenum && jit->code_free[i].off < off) {
+        i++;
+    }
+
+    if (i > 0 && jit->code_free[i-1].off + jit->code_free[i-1].size == off) {
+        r = &jit->code_free[i-1];
+        r->size += size;
+        if (i < jit->code_freenum && off + size == r[1].off) {
+            r->size += r[1].size;
+            memmove(r+1, r+2, (jit->code_freenum - (i+1)) * sizeof(*r));
+            jit->code_freenum--;
+        }
+        return;
+    }
+
+    if (i < jit->code_freenum && off + size == jit->code_free[i].off) {
+        jit->code_free[i].off = off;
+        jit->code_free[i].size += size;
+        return;
+    }
+
+    r = (struct code_range*) realloc(jit->code_free, (jit->code_freenum + 1) * sizeof(*r));
+    if (r == NULL) {
+        return;
+    }
+
+    jit->code_free = r;
+    memmove(r+i+1, r+i, (jit->code_freenum - i) * sizeof(*r));
+    jit->code_freenum++;
+    r[i].off = off;
+    r[i].size = size;
+}
+
+#else
+void init_code_pages(struct jit* jit)
+{}
+
+void free_code_pages(struct jit* jit)
+{
+    size_t i;
+    for (i = 0; i < jit->pagenum; i++) {
+        FreePage(jit->pages[i], jit->pages[i]->size);
+    }
+    for (i = 0; i < jit->pinnednum; i++) {
+        FreePage(jit->pinned[i], jit->pinned[i]->size);
+    }
+    free(jit->pages);
+    free(jit->pinned);
+    free_chunk_lists(jit);
+}
+
+#define alloc_page(jit, L, size) ((struct page*) AllocPage(size))
+#define free_page(jit, page) FreePage(page, page->size)
+#endif
+
+/* Pages are left writable while jit->batch_writable is set and are made
+ * executable by end_code_batch. Double mapped pages are always writable
+ * through the writable view so never need their protection changed. */
+static void enable_write(struct jit* jit, struct page* page)
+{
+    if (!page->writable) {
+        EnableWrite(page, page->size);
+        page->writable = 1;
+    }
+}
+
+static void enable_execute(struct jit* jit, struct page* page)
+{
+    if (page->writable && !jit->batch_writable && !jit->exec_off) {
+        page->writable = 0;
+        EnableExecute(page, page->size);
+    }
+}
+
+/* writable leaves the pages writable until the end of the batch, it must
+ * be the same in the matching end_code_batch */
+void begin_code_batch(struct jit* jit, int writable)
+{
+    jit->batch++;
+    jit->batch_writable += writable;
+}
+
+void end_code_batch(struct jit* jit, int writable)
+{
+    size_t i;
+    if (writable && --jit->batch_writable == 0) {
+        for (i = 0; i < jit->pagenum; i++) {
+            enable_execute(jit, jit->pages[i]);
+        }
+    }
+    if (--jit->batch == 0) {
+        flush_gdb_code(jit);
+    }
+}
+
+/* Each compiled function is stored in a chunk of a page starting with a
+ * jit_head. Freed chunks are kept in the jit->free_chunks lists for reuse.
+ * The free_chunk nodes are kept outside of the pages so that we only need to
+ * enable writes for the page of the chunk being allocated or freed, the
+ * jit_head of a free chunk stores a pointer to its node in jump. Each
+ * jit_head also has the size of the chunk before it so that a freed chunk
+ * can be merged with free chunks on either side.
+ */
 struct jit_head {
-    size_t size;
+    size_t size; /* size of the chunk including the jit_head */
+    size_t prev_size; /* size of the previous chunk, 0 for the first */
     int ref;
+    struct page* page;
+    struct gdb_code* gdb; /* see gdbjit.c */
     uint8_t jump[JUMP_SIZE];
 };
 
+struct free_chunk {
+    struct jit_head* h;
+    struct free_chunk* next;
+    struct free_chunk* prev;
+};
+
+/* ref of a free chunk */
+#define FREE_REF (LUA_NOREF - 1)
+
+#define CHUNK_ALIGN_MASK 15
+#define MIN_CHUNK_SIZE ALIGN_UP(sizeof(struct jit_head) + 1, CHUNK_ALIGN_MASK)
+
 #define LINKTABLE_MAX_SIZE (sizeof(extnames) / sizeof(extnames[0]) * (JUMP_SIZE))
+#define FIRST_CHUNK_OFF ALIGN_UP(sizeof(struct page) + LINKTABLE_MAX_SIZE, CHUNK_ALIGN_MASK)
 
-static cfunction compile(struct jit* jit, lua_State* L, cfunction func, int ref)
+static int size_class(size_t sz)
+{
+    size_t c = sz / CODE_CLASS_SIZE;
+    return c < CODE_SIZE_CLASSES ? (int) c : CODE_SIZE_CLASSES - 1;
+}
+
+static struct free_chunk* get_free_chunk(struct jit_head* h)
+{
+    struct free_chunk* f;
+    memcpy(&f, h->jump, sizeof(f));
+    return f;
+}
+
+/* append_chunk adds a chunk of sz bytes at the end of the used part of the
+ * page */
+static struct jit_head* append_chunk(struct page* page, size_t sz)
+{
+    struct jit_head* h = (struct jit_head*) ((uint8_t*) page + page->off);
+    h->page = page;
+    h->size = sz;
+    h->prev_size = page->last;
+    page->off += sz;
+    page->last = sz;
+    return h;
+}
+
+/* set_chunk_size resizes h and updates the prev_size of the chunk after it */
+static void set_chunk_size(struct jit_head* h, size_t sz)
+{
+    struct page* page = h->page;
+    struct jit_head* next = (struct jit_head*) ((uint8_t*) h + sz);
+
+    h->size = sz;
+    if ((uint8_t*) next < (uint8_t*) page + page->off) {
+        next->prev_size = sz;
+    } else {
+        page->last = sz;
+    }
+}
+
+/* push_free_chunk adds the chunk h to the free lists. The page must be
+ * writable. */
+static void push_free_chunk(struct jit* jit, struct jit_head* h)
+{
+    struct free_chunk** list = &jit->free_chunks[size_class(h->size)];
+    struct free_chunk* f = (struct free_chunk*) malloc(sizeof(struct free_chunk));
+
+    if (f == NULL) {
+        /* leak the chunk until its page is freed */
+        h->ref = LUA_NOREF;
+        return;
+    }
+
+    f->h = h;
+    f->prev = NULL;
+    f->next = *list;
+    if (f->next) {
+        f->next->prev = f;
+    }
+    *list = f;
+
+    h->ref = FREE_REF;
+    memcpy(h->jump, &f, sizeof(f));
+}
+
+static void remove_free_chunk(struct jit* jit, struct free_chunk* f)
+{
+    if (f->prev) {
+        f->prev->next = f->next;
+    } else {
+        jit->free_chunks[size_class(f->h->size)] = f->next;
+    }
+    if (f->next) {
+        f->next->prev = f->prev;
+    }
+    free(f);
+}
+
+/* alloc_free_chunk finds a free chunk of at least sz bytes, splitting off any
+ * unused tail back into the free lists. Returns NULL if none fit. The
+ * returned chunk's page is writable. */
+static struct jit_head* alloc_free_chunk(struct jit* jit, size_t sz)
+{
+    int i;
+    for (i = size_class(sz); i < CODE_SIZE_CLASSES; i++) {
+        struct free_chunk* f;
+        for (f = jit->free_chunks[i]; f != NULL; f = f->next) {
+            struct jit_head* h = f->h;
+
+            if (h->size < sz) {
+                continue;
+            }
+
+            remove_free_chunk(jit, f);
+            enable_write(jit, h->page);
+
+            if (h->size - sz >= MIN_CHUNK_SIZE) {
+                struct jit_head* rest = (struct jit_head*) ((uint8_t*) h + sz);
+                rest->page = h->page;
+                rest->prev_size = sz;
+                set_chunk_size(rest, h->size - sz);
+                push_free_chunk(jit, rest);
+                h->size = sz;
+            }
+
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+static void free_chunk_lists(struct jit* jit)
+{
+    int i;
+    for (i = 0; i < CODE_SIZE_CLASSES; i++) {
+        while (jit->free_chunks[i]) {
+            struct free_chunk* f = jit->free_chunks[i];
+            jit->free_chunks[i] = f->next;
+            free(f);
+        }
+    }
+}
+
+/* names of the CODE_* kinds used in the perf map and gdb and in the
+ * compiles table of ffi.jitstats */
+static const char* const code_names[CODE_KINDS] = {
+    "ffi globals", "ffi call", "ffi vararg call", "ffi callback", "ffi map", "ffi async"
+};
+static const char* const code_stats_names[CODE_KINDS] = {
+    "globals", "call", "vararg", "callback", "map", "async"
+};
+
+/* push_code_name pushes the name used for code in the perf map and gdb,
+ * the kind followed by the type ct if not NULL */
+static void push_code_name(lua_State* L, int kind, int ct_usr, const struct ctype* ct)
+{
+    lua_pushstring(L, code_names[kind]);
+    if (ct) {
+        lua_pushstring(L, " ");
+        push_type_name(L, ct_usr, ct);
+        lua_concat(L, 3);
+    }
+}
+
+/* write_perf_map adds a line for the code at addr to the perf map when
+ * ffi.perfmap is on */
+static void write_perf_map(struct jit* jit, void* addr, size_t size, const char* name)
+{
+    if (jit->perf_map) {
+        fprintf(jit->perf_map, "%llx %llx %s\n", (unsigned long long) (uintptr_t) addr, (unsigned long long) size, name);
+    }
+}
+
+/* ffi.perfmap(on) turns on or off writing a line to /tmp/perf-<pid>.map for
+ * all code compiled from then on, so that perf can name samples in it.
+ * Returns the file name when on. */
+int ffi_perfmap(lua_State* L)
+{
+#ifdef _WIN32
+    return luaL_error(L, "NYI: ffi.perfmap on windows");
+#else
+    struct jit* jit = get_jit(L);
+    char path[64];
+
+    if (!lua_toboolean(L, 1)) {
+        close_perf_map(jit);
+        return 0;
+    }
+
+    sprintf(path, "/tmp/perf-%d.map", (int) getpid());
+
+    if (jit->perf_map == NULL) {
+        jit->perf_map = fopen(path, "a");
+        if (jit->perf_map == NULL) {
+            return luaL_error(L, "failed to open %s", path);
+        }
+        /* so that perf sees each entry even if we crash */
+        setvbuf(jit->perf_map, NULL, _IOLBF, BUFSIZ);
+    }
+
+    lua_pushstring(L, path);
+    return 1;
+#endif
+}
+
+void close_perf_map(struct jit* jit)
+{
+    if (jit->perf_map) {
+        fclose(jit->perf_map);
+        jit->perf_map = NULL;
+    }
+}
+
+/* pin_code returns whether code can be run on other threads while this
+ * thread compiles or frees code. When pages are toggled between writable and
+ * executable this code gets a pinned page to itself that is never made
+ * writable again. */
+static int pin_code(struct jit* jit, int kind, const struct ctype* ct)
+{
+    return !jit->exec_off && (kind == CODE_ASYNC || (kind == CODE_CALLBACK && ct->queued));
+}
+
+/* compile links and encodes the code, the CODE_* kind, ct_usr and ct name
+ * it in the perf map and gdb */
+static cfunction compile(struct jit* jit, lua_State* L, cfunction func, int ref, int kind, int ct_usr, const struct ctype* ct)
 {
     struct jit_head* code;
+    uint8_t* exec;
     size_t codesz;
-    int err;
+    double start;
+    int err, named;
 
     dasm_checkstep(jit, -1);
-    if ((err = dasm_link(jit, &codesz)) != 0) {
+    start = get_time();
+    err = dasm_link(jit, &codesz);
+    jit->link_time += get_time() - start;
+    if (err != 0) {
         char buf[32];
         sprintf(buf, "%x", err);
         luaL_error(L, "dasm_link error %s", buf);
     }
 
+    /* pushed before the code is reserved as it can raise an error */
+    named = jit->perf_map || jit->gdb;
+    if (named) {
+        push_code_name(L, kind, ct_usr, ct);
+    }
+
     codesz += sizeof(struct jit_head);
-    code = (struct jit_head*) reserve_code(jit, L, codesz);
+    code = (struct jit_head*) reserve_code(jit, L, codesz, pin_code(jit, kind, ct));
     code->ref = ref;
-    code->size = codesz;
     compile_extern_jump(jit, L, func, code->jump);
 
-    if ((err = dasm_encode(jit, code+1)) != 0) {
+    start = get_time();
+    err = dasm_encode(jit, code+1);
+    jit->encode_time += get_time() - start;
+    if (err != 0) {
         char buf[32];
         sprintf(buf, "%x", err);
-        commit_code(jit, code, 0);
+        code->ref = LUA_NOREF;
+        release_code(jit, code);
         luaL_error(L, "dasm_encode error %s", buf);
     }
 
-    commit_code(jit, code, codesz);
-    return (cfunction) (code+1);
+    exec = (uint8_t*) (code+1) + jit->exec_off;
+    code->gdb = NULL;
+
+    if (named) {
+        write_perf_map(jit, exec, codesz - sizeof(struct jit_head), lua_tostring(L, -1));
+        code->gdb = add_gdb_code(jit, exec, codesz - sizeof(struct jit_head), lua_tostring(L, -1));
+    }
+
+    commit_code(jit, code);
+    if (named) {
+        lua_pop(L, 1);
+    }
+    jit->compiles[kind]++;
+    jit->code_live++;
+    return (cfunction) exec;
 }
 
 typedef uint8_t jump_t[JUMP_SIZE];
 
 int get_extern(struct jit* jit, uint8_t* addr, int idx, int type)
 {
-    struct page* page = jit->pages[jit->pagenum-1];
-    jump_t* jumps = (jump_t*) (page+1);
-    struct jit_head* h = (struct jit_head*) ((uint8_t*) page + page->off);
+    struct jit_head* h = (struct jit_head*) jit->cur_code;
+    jump_t* jumps = (jump_t*) (h->page+1);
     uint8_t* jmp;
     ptrdiff_t off;
 
@@ -104,8 +599,9 @@ int get_extern(struct jit* jit, uint8_t* addr, int idx, int type)
     addr += BRANCH_OFF;
 
     /* see if we can fit the offset in the branch displacement, if not use the
-     * jump instruction */
-    off = *(uint8_t**) jmp - addr;
+     * jump instruction. addr is in the writable mapping so needs to be offset
+     * to where it will be run from. */
+    off = *(uint8_t**) jmp - (addr + jit->exec_off);
 
     if (MIN_BRANCH <= off && off <= MAX_BRANCH) {
         return (int32_t) off;
@@ -114,108 +610,173 @@ int get_extern(struct jit* jit, uint8_t* addr, int idx, int type)
     }
 }
 
-static void* reserve_code(struct jit* jit, lua_State* L, size_t sz)
+
+/* new_page allocates a writable page with room for sz bytes of code. Pinned
+ * pages are kept in jit->pinned and are never appended to after the first
+ * chunk. */
+static struct page* new_page(struct jit* jit, lua_State* L, size_t sz, int pinned)
 {
     struct page* page;
-    size_t off = (jit->pagenum > 0) ? jit->pages[jit->pagenum-1]->off : 0;
-    size_t size = (jit->pagenum > 0) ? jit->pages[jit->pagenum-1]->size : 0;
-
-    if (off + sz >= size) {
-        int i;
-        uint8_t* pdata;
-        cfunction func;
-
-        /* need to create a new page */
-        jit->pages = (struct page**) realloc(jit->pages, (++jit->pagenum) * sizeof(jit->pages[0]));
+    struct page** pages;
+    size_t size;
+    int i;
+    uint8_t* pdata;
+    cfunction func;
+
+    if (pinned) {
+        pages = (struct page**) realloc(jit->pinned, (jit->pinnednum + 1) * sizeof(jit->pinned[0]));
+        if (pages == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        jit->pinned = pages;
+    } else {
+        pages = (struct page**) realloc(jit->pages, (jit->pagenum + 1) * sizeof(jit->pages[0]));
+        if (pages == NULL) {
+            luaL_error(L, "out of memory");
+        }
+        jit->pages = pages;
+
+        /* give the unused end of the previous page to the free lists */
+        page = jit->cur_page;
+        if (page && page->size - page->off >= MIN_CHUNK_SIZE) {
+            enable_write(jit, page);
+            push_free_chunk(jit, append_chunk(page, page->size - page->off));
+            enable_execute(jit, page);
+        }
+    }
 
-        size = ALIGN_UP(sz + LINKTABLE_MAX_SIZE + sizeof(struct page), jit->align_page_size);
+    size = ALIGN_UP(sz + FIRST_CHUNK_OFF, jit->align_page_size);
 
-        page = (struct page*) AllocPage(size);
-        jit->pages[jit->pagenum-1] = page;
-        pdata = (uint8_t*) page;
-        page->size = size;
-        page->off = sizeof(struct page);
+    page = alloc_page(jit, L, size);
+    if (pinned) {
+        jit->pinned[jit->pinnednum++] = page;
+    } else {
+        page->idx = jit->pagenum;
+        jit->pages[jit->pagenum++] = page;
+        jit->cur_page = page;
+    }
+    pdata = (uint8_t*) page;
+    page->size = size;
+    page->off = sizeof(struct page);
+    page->live = 0;
+    page->last = 0;
+    page->writable = 1;
+    page->pinned = pinned;
 
-        lua_newtable(L);
+    lua_newtable(L);
 
 #define ADDFUNC(DLL, NAME) \
-        lua_pushliteral(L, #NAME); \
-        func = DLL ? (cfunction) GetProcAddressA(DLL, #NAME) : NULL; \
-        func = func ? func : (cfunction) &NAME; \
-        lua_pushcfunction(L, (lua_CFunction) func); \
-        lua_rawset(L, -3)
-
-        ADDFUNC(NULL, check_double);
-        ADDFUNC(NULL, check_float);
-        ADDFUNC(NULL, check_uint64);
-        ADDFUNC(NULL, check_int64);
-        ADDFUNC(NULL, check_int32);
-        ADDFUNC(NULL, check_uint32);
-        ADDFUNC(NULL, check_uintptr);
-        ADDFUNC(NULL, check_enum);
-        ADDFUNC(NULL, check_typed_pointer);
-        ADDFUNC(NULL, check_typed_cfunction);
-        ADDFUNC(NULL, check_complex_double);
-        ADDFUNC(NULL, check_complex_float);
-        ADDFUNC(NULL, unpack_varargs_stack);
-        ADDFUNC(NULL, unpack_varargs_stack_skip);
-        ADDFUNC(NULL, unpack_varargs_reg);
-        ADDFUNC(NULL, unpack_varargs_float);
-        ADDFUNC(NULL, unpack_varargs_int);
-        ADDFUNC(NULL, push_cdata);
-        ADDFUNC(NULL, push_int);
-        ADDFUNC(NULL, push_uint);
-        ADDFUNC(NULL, push_float);
-        ADDFUNC(jit->kernel32_dll, SetLastError);
-        ADDFUNC(jit->kernel32_dll, GetLastError);
-        ADDFUNC(jit->lua_dll, luaL_error);
-        ADDFUNC(jit->lua_dll, lua_pushnumber);
-        ADDFUNC(jit->lua_dll, lua_pushboolean);
-        ADDFUNC(jit->lua_dll, lua_gettop);
-        ADDFUNC(jit->lua_dll, lua_rawgeti);
-        ADDFUNC(jit->lua_dll, lua_pushnil);
-        ADDFUNC(jit->lua_dll, lua_callk);
-        ADDFUNC(jit->lua_dll, lua_settop);
-        ADDFUNC(jit->lua_dll, lua_remove);
+    lua_pushliteral(L, #NAME); \
+    func = DLL ? (cfunction) GetProcAddressA(DLL, #NAME) : NULL; \
+    func = func ? func : (cfunction) &NAME; \
+    lua_pushcfunction(L, (lua_CFunction) func); \
+    lua_rawset(L, -3)
+
+    ADDFUNC(NULL, check_double);
+    ADDFUNC(NULL, check_float);
+    ADDFUNC(NULL, check_uint64);
+    ADDFUNC(NULL, check_int64);
+    ADDFUNC(NULL, check_int32);
+    ADDFUNC(NULL, check_uint32);
+    ADDFUNC(NULL, check_uintptr);
+    ADDFUNC(NULL, check_enum);
+    ADDFUNC(NULL, check_typed_pointer);
+    ADDFUNC(NULL, check_typed_cfunction);
+    ADDFUNC(NULL, check_complex_double);
+    ADDFUNC(NULL, check_complex_float);
+    ADDFUNC(NULL, unpack_varargs_stack);
+    ADDFUNC(NULL, unpack_varargs_stack_skip);
+    ADDFUNC(NULL, unpack_varargs_reg);
+    ADDFUNC(NULL, unpack_varargs_float);
+    ADDFUNC(NULL, unpack_varargs_int);
+    ADDFUNC(NULL, check_vararg_pointer);
+    ADDFUNC(NULL, push_cdata);
+    ADDFUNC(NULL, push_int);
+    ADDFUNC(NULL, push_uint);
+    ADDFUNC(NULL, push_float);
+    ADDFUNC(NULL, queue_reserve);
+    ADDFUNC(NULL, queue_commit);
+    ADDFUNC(jit->kernel32_dll, SetLastError);
+    ADDFUNC(jit->kernel32_dll, GetLastError);
+    ADDFUNC(jit->lua_dll, luaL_error);
+    ADDFUNC(jit->lua_dll, lua_pushnumber);
+    ADDFUNC(jit->lua_dll, lua_pushboolean);
+    ADDFUNC(jit->lua_dll, lua_type);
+    ADDFUNC(jit->lua_dll, lua_tonumberx);
+    ADDFUNC(jit->lua_dll, lua_toboolean);
+    ADDFUNC(jit->lua_dll, lua_touserdata);
+    ADDFUNC(jit->lua_dll, lua_gettop);
+    ADDFUNC(jit->lua_dll, lua_rawgeti);
+    ADDFUNC(jit->lua_dll, lua_pushnil);
+    ADDFUNC(jit->lua_dll, lua_callk);
+    ADDFUNC(jit->lua_dll, lua_settop);
+    ADDFUNC(jit->lua_dll, lua_remove);
+    ADDFUNC(jit->lua_dll, lua_pushvalue);
 #undef ADDFUNC
 
-        for (i = 0; extnames[i] != NULL; i++) {
-
-            if (strcmp(extnames[i], "FUNCTION") == 0) {
-                shred(pdata + page->off, 0, JUMP_SIZE);
-                jit->function_extern = i;
+    for (i = 0; extnames[i] != NULL; i++) {
 
-            } else {
-                lua_getfield(L, -1, extnames[i]);
-                func = (cfunction) lua_tocfunction(L, -1);
+        if (strcmp(extnames[i], "FUNCTION") == 0) {
+            shred(pdata + page->off, 0, JUMP_SIZE);
+            jit->function_extern = i;
 
-                if (func == NULL) {
-                    luaL_error(L, "internal error: missing link for %s", extnames[i]);
-                }
+        } else {
+            lua_getfield(L, -1, extnames[i]);
+            func = (cfunction) lua_tocfunction(L, -1);
 
-                compile_extern_jump(jit, L, func, pdata + page->off);
-                lua_pop(L, 1);
+            if (func == NULL) {
+                luaL_error(L, "internal error: missing link for %s", extnames[i]);
             }
 
-            page->off += JUMP_SIZE;
+            compile_extern_jump(jit, L, func, pdata + page->off);
+            lua_pop(L, 1);
         }
 
-        page->freed = page->off;
-        lua_pop(L, 1);
+        page->off += JUMP_SIZE;
+    }
 
-    } else {
-        page = jit->pages[jit->pagenum-1];
-        EnableWrite(page, page->size);
+    page->off = FIRST_CHUNK_OFF;
+    lua_pop(L, 1);
+
+    return page;
+}
+
+/* reserve_code returns a writable jit_head for a chunk of at least sz
+ * bytes, on a new pinned page if pinned is set. This is the chunk that
+ * get_extern will link against. */
+static void* reserve_code(struct jit* jit, lua_State* L, size_t sz, int pinned)
+{
+    struct page* page = jit->cur_page;
+    struct jit_head* h;
+
+    sz = ALIGN_UP(sz, CHUNK_ALIGN_MASK);
+    h = pinned ? NULL : alloc_free_chunk(jit, sz);
+
+    if (h == NULL) {
+        if (pinned || page == NULL || page->off + sz > page->size) {
+            page = new_page(jit, L, sz, pinned);
+        } else {
+            enable_write(jit, page);
+        }
+
+        h = append_chunk(page, sz);
     }
 
-    return (uint8_t*) page + page->off;
+    h->page->live += h->size;
+    jit->cur_code = h;
+    return h;
 }
 
-static void commit_code(struct jit* jit, void* code, size_t sz)
+static void commit_code(struct jit* jit, void* code)
 {
-    struct page* page = jit->pages[jit->pagenum-1];
-    page->off += sz;
-    EnableExecute(page, page->size);
+    struct page* page = ((struct jit_head*) code)->page;
+    if (page->pinned) {
+        /* not deferred to the end of a batch as it's never written again */
+        page->writable = 0;
+        EnableExecute(page, page->size);
+    } else {
+        enable_execute(jit, page);
+    }
     {
 #if 0
         FILE* out = fopen("\\Hard Disk\\out.bin", "wb");
@@ -225,45 +786,208 @@ static void commit_code(struct jit* jit, void* code, size_t sz)
     }
 }
 
+static void release_page(struct jit* jit, struct page* page)
+{
+    uint8_t* p;
+    struct page* last;
+    size_t i;
+
+    if (page->pinned) {
+        /* search as the idx of the moved page can't be updated */
+        for (i = 0; jit->pinned[i] != page; i++) {}
+        jit->pinned[i] = jit->pinned[--jit->pinnednum];
+        free_page(jit, page);
+        return;
+    }
+
+    /* remove any free chunks in the page from the free lists */
+    for (p = (uint8_t*) page + FIRST_CHUNK_OFF; p < (uint8_t*) page + page->off; p += ((struct jit_head*) p)->size) {
+        struct jit_head* h = (struct jit_head*) p;
+        if (h->ref == FREE_REF) {
+            remove_free_chunk(jit, get_free_chunk(h));
+        }
+    }
+
+    if (jit->cur_page == page) {
+        jit->cur_page = NULL;
+    }
+
+    last = jit->pages[--jit->pagenum];
+    if (last != page) {
+        enable_write(jit, last);
+        last->idx = page->idx;
+        enable_execute(jit, last);
+        jit->pages[page->idx] = last;
+    }
+
+    free_page(jit, page);
+}
+
+/* release_code returns the chunk to the free lists, or frees the page if it
+ * has no other code in it. The page must be writable. */
+static void release_code(struct jit* jit, void* code)
+{
+    struct jit_head* h = (struct jit_head*) code;
+    struct page* page = h->page;
+    uint8_t* end = (uint8_t*) page + page->off;
+    struct jit_head* next = (struct jit_head*) ((uint8_t*) h + h->size);
+
+    page->live -= h->size;
+
+    if (page->live == 0) {
+        release_page(jit, page);
+        return;
+    }
+
+    if ((uint8_t*) next < end && next->ref == FREE_REF) {
+        /* merge with the next chunk */
+        remove_free_chunk(jit, get_free_chunk(next));
+        next = (struct jit_head*) ((uint8_t*) next + next->size);
+        set_chunk_size(h, (uint8_t*) next - (uint8_t*) h);
+    }
+
+    shred(h, sizeof(struct jit_head), h->size);
+
+    if (h->prev_size) {
+        struct jit_head* prev = (struct jit_head*) ((uint8_t*) h - h->prev_size);
+        if (prev->ref == FREE_REF) {
+            /* merge with the previous chunk */
+            remove_free_chunk(jit, get_free_chunk(prev));
+            set_chunk_size(prev, prev->size + h->size);
+            h = prev;
+        }
+    }
+
+    if ((uint8_t*) next == end && page == jit->cur_page) {
+        /* chunk is at the end of the page being appended to */
+        page->off -= h->size;
+        page->last = h->prev_size;
+    } else {
+        push_free_chunk(jit, h);
+    }
+
+    enable_execute(jit, page);
+}
+
 /* push_func_ref pushes a copy of the upval table embedded in the compiled
  * function func.
  */
 void push_func_ref(lua_State* L, cfunction func)
 {
+    /* the executable view is readable as well so no need to convert func */
     struct jit_head* h = ((struct jit_head*) func) - 1;
     lua_rawgeti(L, LUA_REGISTRYINDEX, h->ref);
 }
 
+/* free_code frees the code func, which may be NULL if it's already been
+ * freed */
 void free_code(struct jit* jit, lua_State* L, cfunction func)
 {
-    size_t i;
-    struct jit_head* h = ((struct jit_head*) func) - 1;
-    for (i = 0; i < jit->pagenum; i++) {
-        struct page* p = jit->pages[i];
+    struct jit_head* h;
 
-        if ((uint8_t*) h < (uint8_t*) p || (uint8_t*) p + p->size <= (uint8_t*) h) {
-            continue;
-        }
+    if (func == NULL) {
+        return;
+    }
 
-        luaL_unref(L, LUA_REGISTRYINDEX, h->ref);
+    h = ((struct jit_head*) ((uint8_t*) func - jit->exec_off)) - 1;
+    if (h->ref != LUA_NOREF) {
+        /* callbacks also own the registry slot of their lua function */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, h->ref);
+        lua_rawgeti(L, -1, CALLBACK_FUNC_USR_IDX);
+        luaL_unref(L, LUA_REGISTRYINDEX, (int) lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        cancel_queued_calls(L, -1);
+        lua_pop(L, 1);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, h->ref);
+    /* perf maps can't remove entries, so mark the range as freed */
+    write_perf_map(jit, func, h->size - sizeof(struct jit_head), "ffi freed");
+    if (h->gdb) {
+        free_gdb_code(jit, h->gdb);
+    }
+    jit->code_live--;
+    jit->code_freed += h->size;
+    if (h->page->pinned) {
+        /* the chunk is the only one in the page */
+        release_page(jit, h->page);
+    } else {
+        enable_write(jit, h->page);
+        release_code(jit, h);
+    }
+}
 
-        EnableWrite(p, p->size);
-        p->freed += h->size;
+/* push_code_stats pushes a table describing the use of the jit code pages
+ * and the number and cost of compiles */
+void push_code_stats(lua_State* L, struct jit* jit)
+{
+    size_t i, size = 0, live = 0, freesz = 0, chunks = 0, largest = 0, unused = 0;
 
-        shred(h, 0, h->size);
+    for (i = 0; i < jit->pagenum; i++) {
+        size += jit->pages[i]->size;
+        live += jit->pages[i]->live;
+    }
+    for (i = 0; i < jit->pinnednum; i++) {
+        size += jit->pinned[i]->size;
+        live += jit->pinned[i]->live;
+    }
 
-        if (p->freed < p->off) {
-            EnableExecute(p, p->size);
-            return;
+    for (i = 0; i < CODE_SIZE_CLASSES; i++) {
+        struct free_chunk* f;
+        for (f = jit->free_chunks[i]; f != NULL; f = f->next) {
+            freesz += f->h->size;
+            chunks++;
+            if (f->h->size > largest) {
+                largest = f->h->size;
+            }
         }
+    }
 
-        FreePage(p, p->size);
-        memmove(&jit->pages[i], &jit->pages[i+1], (jit->pagenum - (i+1)) * sizeof(jit->pages[0]));
-        jit->pagenum--;
-        return;
+    if (jit->cur_page) {
+        unused = jit->cur_page->size - jit->cur_page->off;
     }
 
-    assert(!"couldn't find func in the jit pages");
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number) (jit->pagenum + jit->pinnednum));
+    lua_setfield(L, -2, "pages");
+    lua_pushnumber(L, (lua_Number) size);
+    lua_setfield(L, -2, "size");
+    lua_pushnumber(L, (lua_Number) live);
+    lua_setfield(L, -2, "used");
+    lua_pushnumber(L, (lua_Number) freesz);
+    lua_setfield(L, -2, "free");
+    lua_pushnumber(L, (lua_Number) chunks);
+    lua_setfield(L, -2, "free_chunks");
+    lua_pushnumber(L, (lua_Number) largest);
+    lua_setfield(L, -2, "largest_free");
+    lua_pushnumber(L, (lua_Number) unused);
+    lua_setfield(L, -2, "unused");
+
+    /* fraction of the free memory that can't be used for the largest
+     * possible allocation */
+    lua_pushnumber(L, freesz ? 1 - (lua_Number) largest / freesz : 0);
+    lua_setfield(L, -2, "fragmentation");
+
+    lua_pushnumber(L, (lua_Number) jit->code_live);
+    lua_setfield(L, -2, "live");
+    lua_pushnumber(L, (lua_Number) jit->code_freed);
+    lua_setfield(L, -2, "freed");
+    lua_pushnumber(L, jit->link_time);
+    lua_setfield(L, -2, "link_time");
+    lua_pushnumber(L, jit->encode_time);
+    lua_setfield(L, -2, "encode_time");
+
+    lua_createtable(L, 0, CODE_KINDS);
+    for (i = 0; i < CODE_KINDS; i++) {
+        lua_pushnumber(L, (lua_Number) jit->compiles[i]);
+        lua_setfield(L, -2, code_stats_names[i]);
+    }
+    lua_setfield(L, -2, "compiles");
 }
 
-
+/* ffi.jitstats() returns a table describing the code pages and what has
+ * been compiled, see push_code_stats */
+int ffi_jitstats(lua_State* L)
+{
+    push_code_stats(L, get_jit(L));
+    return 1;
+}
@@ -3,9 +3,9 @@
  */
 #include "ffi.h"
 
-static int to_define_key;
+int to_define_key;
 
-static void update_on_definition(lua_State* L, int ct_usr, int ct_idx)
+void update_on_definition(lua_State* L, int ct_usr, int ct_idx)
 {
     ct_usr = lua_absindex(L, ct_usr);
     ct_idx = lua_absindex(L, ct_idx);
@@ -128,11 +128,60 @@ size_t ctype_size(lua_State* L, const struct ctype* ct)
     }
 }
 
-void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
+/* maps sz bytes of zeroed memory for a large cdata, returns NULL on failure
+ * and updates sz to the size mapped */
+static void* map_large(struct jit* jit, size_t* sz)
+{
+    void* p;
+
+#ifdef MAP_HUGETLB
+    if (jit->large_huge == LARGE_HUGE_TLB) {
+        size_t hsz = ALIGN_UP(*sz, HUGE_PAGE_MASK);
+        p = mmap(NULL, hsz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *sz = hsz;
+            return p;
+        }
+        /* no huge pages reserved, fall back to normal pages */
+    }
+#endif
+
+    p = AllocPage(*sz);
+
+#ifdef _WIN32
+    if (p == NULL) {
+        return NULL;
+    }
+#else
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    if (jit->large_huge == LARGE_HUGE_MADVISE) {
+        madvise(p, *sz, MADV_HUGEPAGE);
+    }
+#endif
+
+    return p;
+}
+
+static void* do_push_cdata(lua_State* L, int ct_usr, const struct ctype* ct, int zero)
 {
     struct cdata* cd;
+    char* data;
     size_t sz = ct->is_reference ? sizeof(void*) : ctype_size(L, ct);
-    ct_usr = lua_absindex(L, ct_usr);
+    size_t used = sz;
+    int referable = !ct->is_reference
+        && (ct->is_array || (!ct->pointers && (ct->type == STRUCT_TYPE || ct->type == UNION_TYPE)));
+    int indirect = referable && ct->align_mask > USERDATA_ALIGN_MASK;
+    struct large_cdata* large = NULL;
+
+    /* 0 means no user value, lua_absindex would turn it into the new top */
+    if (ct_usr) {
+        ct_usr = lua_absindex(L, ct_usr);
+    }
 
     /* This is to stop valgrind from complaining. Bitfields are accessed in 8
      * byte chunks so that the code doesn't have to deal with different access
@@ -145,15 +194,51 @@ void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
         sz = ALIGN_UP(sz, 7);
     }
 
-    cd = (struct cdata*) lua_newuserdata(L, sizeof(struct cdata) + sz);
-    *(struct ctype*) &cd->type = *ct;
-    memset(cd+1, 0, sz);
+    if (referable && sz >= LARGE_MIN_SIZE) {
+        struct jit* jit = get_jit(L);
 
-    /* TODO: handle cases where lua_newuserdata returns a pointer that is not
-     * aligned */
-#if 0
-    assert((uintptr_t) (cd + 1) % 8 == 0);
-#endif
+        if (jit->large_threshold && sz >= jit->large_threshold) {
+            /* the mapping is outside of the lua heap, so step the gc as if
+             * it had been allocated by lua */
+            lua_gc(L, LUA_GCSTEP, (int) (sz >> 10));
+
+            cd = (struct cdata*) lua_newuserdata(L, sizeof(struct cdata) + sizeof(struct large_cdata));
+            large = (struct large_cdata*) (cd+1);
+            large->size = sz;
+            large->data = map_large(jit, &large->size);
+
+            if (large->data == NULL) {
+                lua_pop(L, 1);
+                large = NULL;
+            }
+        }
+    }
+
+    if (large) {
+        /* freshly mapped pages are already zeroed */
+        *(struct ctype*) &cd->type = *ct;
+        ((struct ctype*) &cd->type)->is_reference = 1;
+        data = (char*) large->data;
+
+    } else if (indirect) {
+        /* lua_newuserdata only guarantees USERDATA_ALIGN_MASK, so over
+         * aligned structs, unions and arrays are pushed as a reference to an
+         * aligned block following the pointer, the same as a member */
+        cd = (struct cdata*) lua_newuserdata(L, sizeof(struct cdata) + sizeof(void*) + ct->align_mask + sz);
+        *(struct ctype*) &cd->type = *ct;
+        ((struct ctype*) &cd->type)->is_reference = 1;
+        data = (char*) ALIGN_UP((char*) (cd+1) + sizeof(void*), ct->align_mask);
+        *(void**) (cd+1) = data;
+    } else {
+        cd = (struct cdata*) lua_newuserdata(L, sizeof(struct cdata) + sz);
+        *(struct ctype*) &cd->type = *ct;
+        data = (char*) (cd+1);
+    }
+
+    if (!large) {
+        /* the bitfield padding is always zeroed for the valgrind reason above */
+        memset(data + (zero ? 0 : used), 0, zero ? sz : sz - used);
+    }
 
 #if LUA_VERSION_NUM == 501
     if (!ct_usr || lua_isnil(L, ct_usr)) {
@@ -167,16 +252,24 @@ void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
         lua_setuservalue(L, -2);
     }
 
-    push_upval(L, &cdata_mt_key);
+    push_upval(L, large ? &cdata_large_mt_key : &cdata_mt_key);
     lua_setmetatable(L, -2);
 
     if (!ct->is_defined && ct_usr && !lua_isnil(L, ct_usr)) {
         update_on_definition(L, ct_usr, -1);
     }
 
-    return cd+1;
+    return data;
 }
 
+void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
+{ return do_push_cdata(L, ct_usr, ct, 1); }
+
+/* push_uninit_cdata is push_cdata without zeroing the data, for callers
+ * that are about to fill it in */
+void* push_uninit_cdata(lua_State* L, int ct_usr, const struct ctype* ct)
+{ return do_push_cdata(L, ct_usr, ct, 0); }
+
 void push_callback(lua_State* L, cfunction f)
 {
     cfunction* pf = (cfunction*) lua_newuserdata(L, sizeof(cfunction));
@@ -186,11 +279,51 @@ void push_callback(lua_State* L, cfunction f)
     lua_setmetatable(L, -2);
 }
 
+/* Type strings passed to ffi.new, ffi.cast, etc are parsed once and the
+ * result kept in the type cache as a ctype userdata keyed by the string.
+ * Types can change when a cdef defines an incomplete struct or adds
+ * typedefs, so ffi.cdef clears the cache. The cache is replaced once it
+ * reaches TYPE_CACHE_SIZE entries so that generated type strings can't grow
+ * it without bound. */
+#define TYPE_CACHE_SIZE 256
+
+void clear_type_cache(lua_State* L)
+{
+    lua_pushnil(L);
+    set_upval(L, &type_cache_key);
+    get_jit(L)->type_cache_num = 0;
+}
+
 /* returns the value as a ctype, pushes the user value onto the stack */
 void check_ctype(lua_State* L, int idx, struct ctype* ct)
 {
     if (lua_isstring(L, idx)) {
         struct parser P;
+        struct jit* jit;
+        lua_Integer unnamed;
+
+        idx = lua_absindex(L, idx);
+        push_upval(L, &type_cache_key);
+
+        if (!lua_isnil(L, -1)) {
+            lua_pushvalue(L, idx);
+            lua_rawget(L, -2);
+
+            if (!lua_isnil(L, -1)) {
+                *ct = *(const struct ctype*) lua_touserdata(L, -1);
+                lua_getuservalue(L, -1);
+                lua_replace(L, -3);
+                lua_pop(L, 1);
+                return;
+            }
+
+            lua_pop(L, 1);
+        }
+
+        push_upval(L, &next_unnamed_key);
+        unnamed = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+
         P.line = 1;
         P.prev = P.next = lua_tostring(L, idx);
         P.align_mask = DEFAULT_ALIGN_MASK;
@@ -198,9 +331,36 @@ void check_ctype(lua_State* L, int idx, struct ctype* ct)
         parse_argument(L, &P, -1, ct, NULL, NULL);
         lua_remove(L, -2); /* remove the user value from parse_type */
 
+        /* each parse of an anonymous struct, union or enum is a new type, so
+         * those strings aren't cached */
+        push_upval(L, &next_unnamed_key);
+        if (lua_tointeger(L, -1) != unnamed) {
+            lua_pop(L, 1);
+            lua_remove(L, -2);
+            return;
+        }
+        lua_pop(L, 1);
+
+        /* cache tbl, usr */
+        jit = get_jit(L);
+        if (lua_isnil(L, -2) || jit->type_cache_num >= TYPE_CACHE_SIZE) {
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            set_upval(L, &type_cache_key);
+            lua_replace(L, -3);
+            jit->type_cache_num = 0;
+        }
+
+        lua_pushvalue(L, idx);
+        push_ctype(L, -2, ct);
+        lua_rawset(L, -4);
+        jit->type_cache_num++;
+        lua_remove(L, -2);
+
     } else if (lua_getmetatable(L, idx)) {
-        if (!equals_upval(L, -1, &ctype_mt_key)
-                && !equals_upval(L, -1, &cdata_mt_key)) {
+        int is_cdata = is_metatable(L, -1, &cdata_mt_key);
+
+        if (!is_cdata && !is_metatable(L, -1, &ctype_mt_key)) {
             goto err;
         }
 
@@ -208,6 +368,12 @@ void check_ctype(lua_State* L, int idx, struct ctype* ct)
         *ct = *(struct ctype*) lua_touserdata(L, idx);
         lua_getuservalue(L, idx);
 
+        /* the type of a reference cdata (e.g. a struct member or an over
+         * aligned cdata) is the type it refers to */
+        if (is_cdata) {
+            ct->is_reference = 0;
+        }
+
     } else {
         goto err;
     }
@@ -232,7 +398,7 @@ void* to_cdata(lua_State* L, int idx, struct ctype* ct)
         return NULL;
     }
 
-    if (!equals_upval(L, -1, &cdata_mt_key)) {
+    if (!is_metatable(L, -1, &cdata_mt_key)) {
         lua_pop(L, 1); /* mt */
         lua_pushnil(L);
         return NULL;
@@ -11,8 +11,13 @@
 int jit_key;
 int ctype_mt_key;
 int cdata_mt_key;
+int cdata_gc_mt_key;
+int cdata_large_mt_key;
 int callback_mt_key;
+int async_mt_key;
 int cmodule_mt_key;
+static int arena_mt_key;
+static int arena_refs_key;
 int constants_key;
 int types_key;
 int gc_key;
@@ -22,6 +27,8 @@ int abi_key;
 int next_unnamed_key;
 int niluv_key;
 int asmname_key;
+int thunks_key;
+int type_cache_key;
 
 void push_upval(lua_State* L, int* key)
 {
@@ -46,6 +53,20 @@ int equals_upval(lua_State* L, int idx, int* key)
     return ret;
 }
 
+/* The ffi metatables hold a light userdata of their registry key at index
+ * 1, which identifies them with an array lookup instead of fetching the
+ * metatable from the registry. Lua code can't get at the metatables (they
+ * have __metatable set) or create light userdatas, so the tag can't be
+ * forged. */
+int is_metatable(lua_State* L, int idx, int* key)
+{
+    void* tag;
+    lua_rawgeti(L, idx, MT_TAG_IDX);
+    tag = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return tag == key;
+}
+
 struct jit* get_jit(lua_State* L)
 {
     struct jit* jit;
@@ -377,6 +398,141 @@ void unpack_varargs_reg(lua_State* L, int first, int last, char* to)
     }
 }
 
+/* check_vararg_pointer converts a variadic argument that vararg_key found
+ * to be a VARARG_POINTER */
+void* check_vararg_pointer(lua_State* L, int idx)
+{
+    union {
+        double d;
+        int64_t i;
+        void* p;
+    } u;
+    unpack_vararg(L, idx, (char*) &u);
+    return u.p;
+}
+
+/* vararg_key packs the kind of each of the variadic arguments into 2 bits
+ * each after a leading 1 bit. It returns 0 if they can't be passed by a
+ * specialized thunk. */
+static int vararg_key(lua_State* L, int first, int last)
+{
+    int i, key = 1;
+    struct ctype ct;
+
+    if (first > last + 1 || last - first + 1 > VARARG_MAX_ARGS) {
+        return 0;
+    }
+
+    for (i = first; i <= last; i++) {
+        switch (lua_type(L, i)) {
+        case LUA_TNUMBER:
+            key = (key << 2) | 1;
+            break;
+
+        case LUA_TBOOLEAN:
+            key = (key << 2) | 2;
+            break;
+
+        case LUA_TSTRING:
+        case LUA_TLIGHTUSERDATA:
+        case LUA_TNIL:
+            key = (key << 2) | 3;
+            break;
+
+        case LUA_TUSERDATA:
+            to_cdata(L, i, &ct);
+            lua_pop(L, 1);
+            /* ct is only filled in for cdata */
+            if (ct.type == INVALID_TYPE || (!ct.pointers && ct.type != INTPTR_TYPE)) {
+                return 0;
+            }
+            key = (key << 2) | 3;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+
+    return key;
+}
+
+/* count_vararg_key returns how many times key has been seen recently */
+static int count_vararg_key(struct vararg_site* site, int key)
+{
+    int i, min = 0;
+
+    for (i = 0; i < VARARG_SEEN; i++) {
+        if (site->seen_keys[i] == key) {
+            return ++site->seen_count[i];
+        } else if (site->seen_count[i] < site->seen_count[min]) {
+            min = i;
+        }
+    }
+
+    site->seen_keys[min] = key;
+    site->seen_count[min] = 1;
+    return 1;
+}
+
+static cfunction specialize_vararg(lua_State* L, struct vararg_site* site, int key)
+{
+    static const char kinds[] = {0, VARARG_NUMBER, VARARG_BOOL, VARARG_POINTER};
+    char varargs[VARARG_MAX_ARGS + 1];
+    int i, n = 0, top = lua_gettop(L);
+    struct cdata* cd;
+    cfunction f;
+
+    while ((key >> (2 * n)) > 1) {
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        varargs[i] = kinds[(key >> (2 * (n - i - 1))) & 3];
+    }
+    varargs[n] = '\0';
+
+    /* upvalue 1 is the function cdata which has the prototype */
+    cd = (struct cdata*) lua_touserdata(L, lua_upvalueindex(1));
+    lua_getuservalue(L, lua_upvalueindex(1));
+    f = compile_vararg_function(L, -1, &cd->type, varargs);
+
+    /* keep the code alive as long as the site */
+    lua_getuservalue(L, lua_upvalueindex(2));
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, (int) site->specnum + 1);
+
+    site->spec_keys[site->specnum] = key;
+    site->spec[site->specnum] = f;
+    site->specnum++;
+
+    lua_settop(L, top);
+    return f;
+}
+
+/* call_vararg is the lua function for variadic C functions. Upvalue 2 is the
+ * struct vararg_site, the rest of the upvalues are the same as the thunks
+ * expect so they can be called directly. */
+int call_vararg(lua_State* L)
+{
+    struct vararg_site* site = (struct vararg_site*) lua_touserdata(L, lua_upvalueindex(2));
+    int key = vararg_key(L, site->nfixed + 1, lua_gettop(L));
+    size_t i;
+
+    if (key) {
+        for (i = 0; i < site->specnum; i++) {
+            if (site->spec_keys[i] == key) {
+                return ((lua_CFunction) site->spec[i])(L);
+            }
+        }
+
+        if (site->specnum < VARARG_SPECIALIZED && count_vararg_key(site, key) >= VARARG_WARMUP) {
+            return ((lua_CFunction) specialize_vararg(L, site, key))(L);
+        }
+    }
+
+    return ((lua_CFunction) site->generic)(L);
+}
+
 /* to_enum tries to convert a value at idx to the enum type indicated by to_ct
  * and uv to_usr. For strings this means it will do a string lookup for the
  * enum type. It leaves the stack unchanged. Will throw an error if the type
@@ -653,7 +809,6 @@ err:
 cfunction check_typed_cfunction(lua_State* L, int idx, int to_usr, const struct ctype* tt)
 { return check_cfunction(L, idx, to_usr, tt, 1); }
 
-static void set_value(lua_State* L, int idx, void* to, int to_usr, const struct ctype* tt, int check_pointers);
 
 static void set_array(lua_State* L, int idx, void* to, int to_usr, const struct ctype* tt, int check_pointers)
 {
@@ -860,7 +1015,7 @@ err:
     type_error(L, idx, NULL, to_usr, tt);
 }
 
-static void set_value(lua_State* L, int idx, void* to, int to_usr, const struct ctype* tt, int check_pointers)
+void set_value(lua_State* L, int idx, void* to, int to_usr, const struct ctype* tt, int check_pointers)
 {
     int top = lua_gettop(L);
 
@@ -1042,18 +1197,175 @@ static int try_set_value(lua_State* L)
     return 0;
 }
 
-static int do_new(lua_State* L, int is_cast)
+/* Most cdata never need finalizing, so push_cdata gives them cdata_mt which
+ * has no __gc. Once a cdata has an ffi.gc or __gc metatype function or a
+ * cached call closure, set_cdata_gc switches it to cdata_gc_mt, which is
+ * the same apart from __gc and is tagged as cdata_mt so it is still
+ * recognized as a cdata. */
+static void set_cdata_gc(lua_State* L, int idx)
+{
+    idx = lua_absindex(L, idx);
+
+    /* cdata_large_mt already calls the gc functions before unmapping */
+    push_upval(L, &cdata_large_mt_key);
+    lua_getmetatable(L, idx);
+    if (lua_rawequal(L, -1, -2)) {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_pop(L, 2);
+
+    push_upval(L, &cdata_gc_mt_key);
+    lua_setmetatable(L, idx);
+}
+
+/* if the user mt has a __gc function then call ffi.gc on the cdata at the
+ * top of the stack, which has the ctype usr below it */
+static void set_user_gc(lua_State* L, const struct ctype* ct)
+{
+    if (push_user_mt(L, -2, ct)) {
+        push_upval(L, &gc_key);
+        lua_pushvalue(L, -3);
+
+        /* user_mt.__gc */
+        lua_pushliteral(L, "__gc");
+        lua_rawget(L, -4);
+
+        if (!lua_isnil(L, -1)) {
+            set_cdata_gc(L, -2);
+        }
+
+        lua_rawset(L, -3); /* gc_upval[cdata] = user_mt.__gc */
+        lua_pop(L, 2); /* user_mt and gc_upval */
+    }
+}
+
+/* An arena is a userdata with the struct arena header followed by the
+ * block that arena:new bump allocates from. References returned by arena:new
+ * are no longer valid after a reset, so rather than allocating a new
+ * userdata each time arena:new points the reference returned by the same
+ * call before the reset at the new data when it was created from the same
+ * ctype argument and there are no constructor arguments. The user value of
+ * the arena is a weak valued table with the reference returned by the ith
+ * call since the reset at 2i-1 and the ctype argument it was created from at
+ * 2i. */
+struct arena {
+    size_t size;
+    size_t used;
+    int count; /* references returned since the last reset */
+};
+
+static struct arena* check_arena(lua_State* L, int idx)
+{
+    if (!lua_getmetatable(L, idx) || !is_metatable(L, -1, &arena_mt_key)) {
+        luaL_argerror(L, idx, "expected an arena");
+    }
+    lua_pop(L, 1);
+    return (struct arena*) lua_touserdata(L, idx);
+}
+
+/* returns zeroed space for ct in the arena */
+static void* arena_alloc(lua_State* L, struct arena* a, const struct ctype* ct)
+{
+    char* base = (char*) (a + 1);
+    uintptr_t p = ALIGN_UP((uintptr_t) (base + a->used), ct->align_mask);
+    size_t sz;
+
+    /* these are the types that are pushed as references when they are
+     * members, scalars and pointers are copied out instead */
+    if (ct->pointers ? !ct->is_array : (ct->type != STRUCT_TYPE && ct->type != UNION_TYPE)) {
+        luaL_error(L, "arena can only allocate structs, unions and arrays");
+    }
+
+    sz = ctype_size(L, ct);
+
+    if (ct->has_bitfield) {
+        sz = ALIGN_UP(sz, 7);
+    }
+
+    if (p - (uintptr_t) base > a->size || sz > a->size - (p - (uintptr_t) base)) {
+        luaL_error(L, "arena is full, %d of %d bytes used", (int) a->used, (int) a->size);
+    }
+
+    a->used = p - (uintptr_t) base + sz;
+    memset((void*) p, 0, sz);
+    return (void*) p;
+}
+
+/* pushes a reference to zeroed space for ct in the arena at idx. src is
+ * the index of the ctype argument, or 0 if the reference can't be reused
+ * as there are constructor arguments. */
+static void* push_arena_cdata(lua_State* L, int idx, int ct_usr, const struct ctype* ct, int src)
+{
+    struct arena* a = (struct arena*) lua_touserdata(L, idx);
+    struct ctype rt = *ct;
+    void* p = arena_alloc(L, a, ct);
+
+    rt.is_reference = 1;
+    *(void**) push_cdata(L, ct_usr, &rt) = p;
+    a->count++;
+
+    lua_getuservalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 2 * a->count - 1);
+    if (src) {
+        lua_pushvalue(L, src);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_rawseti(L, -2, 2 * a->count);
+    lua_pop(L, 1);
+
+    /* arena_refs[cdata] = arena keeps the arena alive for the cdata */
+    push_upval(L, &arena_refs_key);
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, idx);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    return p;
+}
+
+/* reuse_arena_ref is the fast path of arena:new(ct) with the arena at 1 and
+ * the ctype argument at 2. It pushes the reference returned by the same
+ * call before the last reset pointed at new data, or returns 0 if it can't
+ * be reused. */
+static int reuse_arena_ref(lua_State* L, struct arena* a)
+{
+    struct cdata* cd;
+
+    lua_getuservalue(L, 1);
+    lua_rawgeti(L, -1, 2 * a->count + 2);
+    lua_rawgeti(L, -2, 2 * a->count + 1);
+    cd = (struct cdata*) lua_touserdata(L, -1);
+
+    if (cd == NULL || !lua_rawequal(L, 2, -2)) {
+        lua_settop(L, 2);
+        return 0;
+    }
+
+    *(void**) (cd + 1) = arena_alloc(L, a, &cd->type);
+    a->count++;
+    return 1;
+}
+
+/* The stack starts with the ctype at base followed by the constructor
+ * arguments. For arena:new the arena is left below them at 1 so that it
+ * stays alive until we return. */
+static int do_new(lua_State* L, int is_cast, struct arena* arena)
 {
     int cargs, i;
     void* p;
     struct ctype ct;
     int check_ptrs = !is_cast;
+    int base = arena ? 2 : 1;
 
-    check_ctype(L, 1, &ct);
+    cargs = lua_gettop(L) - base;
+    check_ctype(L, base, &ct);
 
     /* don't push a callback when we have a c function, as cb:set needs a
      * compiled callback from a lua function to work */
-    if (!ct.pointers && ct.type == FUNCTION_PTR_TYPE && (lua_isnil(L, 2) || lua_isfunction(L, 2))) {
+    if (!arena && !ct.pointers && ct.type == FUNCTION_PTR_TYPE && (lua_isnil(L, 2) || lua_isfunction(L, 2))) {
         /* Function cdatas are pinned and must be manually cleaned up by
          * calling func:free(). */
         compile_callback(L, 2, -1, &ct);
@@ -1067,32 +1379,27 @@ static int do_new(lua_State* L, int is_cast)
 
     /* this removes the vararg argument if its needed, and errors if its invalid */
     if (!is_cast) {
-        get_variable_array_size(L, 2, &ct);
+        get_variable_array_size(L, base + 1, &ct);
     }
 
-    p = push_cdata(L, -1, &ct);
-
-    /* if the user mt has a __gc function then call ffi.gc on this value */
-    if (push_user_mt(L, -2, &ct)) {
-        push_upval(L, &gc_key);
-        lua_pushvalue(L, -3);
-
-        /* user_mt.__gc */
-        lua_pushliteral(L, "__gc");
-        lua_rawget(L, -4);
+    if (arena) {
+        /* arena cdata go with the arena, so __gc metamethods aren't run */
+        p = push_arena_cdata(L, 1, -1, &ct, cargs == 0 ? base : 0);
 
-        lua_rawset(L, -3); /* gc_upval[cdata] = user_mt.__gc */
-        lua_pop(L, 2); /* user_mt and gc_upval */
+    } else {
+        p = push_cdata(L, -1, &ct);
+        set_user_gc(L, &ct);
     }
 
     /* stack is:
+     * arena (arena:new only)
      * ctype arg
      * ctor args ... 0+
      * ctype usr
      * cdata
      */
 
-    cargs = lua_gettop(L) - 3;
+    cargs = lua_gettop(L) - base - 2;
 
     if (cargs == 0) {
         return 1;
@@ -1104,7 +1411,7 @@ static int do_new(lua_State* L, int is_cast)
          * unpacked: ffi.new('int[3]', 1)
          */
         lua_pushcfunction(L, &try_set_value);
-        lua_pushvalue(L, 2); /* ctor arg */
+        lua_pushvalue(L, base + 1); /* ctor arg */
         lua_pushlightuserdata(L, p);
         lua_pushvalue(L, -5); /* ctype usr */
         lua_pushlightuserdata(L, &ct);
@@ -1115,31 +1422,128 @@ static int do_new(lua_State* L, int is_cast)
         }
 
         /* remove any errors */
-        lua_settop(L, 4);
+        lua_settop(L, base + 3);
     }
 
     /* if we have more than 2 ctor arguments then they must be unpacked, e.g.
      * ffi.new('int[3]', 1, 2, 3) */
     lua_createtable(L, cargs, 0);
-    lua_replace(L, 1);
+    lua_replace(L, base);
     for (i = 1; i <= cargs; i++) {
-        lua_pushvalue(L, i + 1);
-        lua_rawseti(L, 1, i);
+        lua_pushvalue(L, base + i);
+        lua_rawseti(L, base, i);
     }
-    assert(lua_gettop(L) == cargs + 3);
-    set_value(L, 1, p, -2, &ct, check_ptrs);
+    assert(lua_gettop(L) == cargs + base + 2);
+    set_value(L, base, p, -2, &ct, check_ptrs);
 
     return 1;
 }
 
 static int ffi_new(lua_State* L)
-{ return do_new(L, 0); }
+{ return do_new(L, 0, NULL); }
 
 static int ffi_cast(lua_State* L)
-{ return do_new(L, 1); }
+{ return do_new(L, 1, NULL); }
+
+/* ffi.alloc(ct [, nelem]) is ffi.new without zeroing the data or taking
+ * initializers, for buffers that are about to be filled in */
+static int ffi_alloc(lua_State* L)
+{
+    struct ctype ct;
+    check_ctype(L, 1, &ct);
+    get_variable_array_size(L, 2, &ct);
+
+    if (lua_gettop(L) > 2) {
+        return luaL_error(L, "ffi.alloc doesn't take initializers");
+    }
+
+    if (ct.type == FUNCTION_PTR_TYPE && !ct.pointers) {
+        return luaL_error(L, "ffi.alloc can't allocate function pointers");
+    }
+
+    push_uninit_cdata(L, -1, &ct);
+    set_user_gc(L, &ct);
+    return 1;
+}
+
+/* ffi.largealloc([threshold [, huge]]) maps structs, unions and arrays of at
+ * least threshold bytes from the OS, nil turns it off. huge is "none",
+ * "madvise" or "hugetlb". Returns the previous threshold. */
+static int ffi_largealloc(lua_State* L)
+{
+    static const char* const huge[] = {"none", "madvise", "hugetlb", NULL};
+    struct jit* jit = get_jit(L);
+    size_t prev = jit->large_threshold;
+
+    if (lua_isnoneornil(L, 1)) {
+        jit->large_threshold = 0;
+    } else {
+        jit->large_threshold = (size_t) luaL_checknumber(L, 1);
+        if (jit->large_threshold < LARGE_MIN_SIZE) {
+            jit->large_threshold = LARGE_MIN_SIZE;
+        }
+    }
+
+    jit->large_huge = luaL_checkoption(L, 2, "none", huge);
+
+    if (prev) {
+        lua_pushnumber(L, (lua_Number) prev);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+/* ffi.arena(bytes) creates an arena that arena:new allocates from */
+static int ffi_arena(lua_State* L)
+{
+    size_t sz = (size_t) luaL_checknumber(L, 1);
+    struct arena* a = (struct arena*) lua_newuserdata(L, sizeof(struct arena) + sz);
+    a->size = sz;
+    a->used = 0;
+    a->count = 0;
+    push_upval(L, &arena_mt_key);
+    lua_setmetatable(L, -2);
+
+    /* weak valued so that references are only kept while in use */
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+/* arena:new(ct, ...) is ffi.new returning a reference into the arena which
+ * keeps the arena alive but is only valid until arena:reset() */
+static int arena_new(lua_State* L)
+{
+    struct arena* a = check_arena(L, 1);
+    if (lua_gettop(L) == 2 && reuse_arena_ref(L, a)) {
+        return 1;
+    }
+    return do_new(L, 0, a);
+}
+
+/* arena:reset() frees everything allocated from the arena in one go */
+static int arena_reset(lua_State* L)
+{
+    struct arena* a = check_arena(L, 1);
+    a->used = 0;
+    a->count = 0;
+    return 0;
+}
+
+/* arena:used() returns the number of bytes allocated, including padding */
+static int arena_used(lua_State* L)
+{
+    lua_pushnumber(L, (lua_Number) check_arena(L, 1)->used);
+    return 1;
+}
 
 static int ctype_new(lua_State* L)
-{ return do_new(L, 0); }
+{ return do_new(L, 0, NULL); }
 
 static int ctype_call(lua_State* L)
 {
@@ -1162,7 +1566,7 @@ static int ctype_call(lua_State* L)
     lua_pop(L, 1);
 
     assert(lua_gettop(L) == top);
-    return do_new(L, 0);
+    return do_new(L, 0, NULL);
 }
 
 static int ffi_sizeof(lua_State* L)
@@ -1282,6 +1686,15 @@ static int cdata_gc(lua_State* L)
     return 0;
 }
 
+/* __gc for cdata_large_mt */
+static int cdata_large_gc(lua_State* L)
+{
+    struct large_cdata large = *(struct large_cdata*) ((struct cdata*) lua_touserdata(L, 1) + 1);
+    cdata_gc(L);
+    FreePage(large.data, large.size);
+    return 0;
+}
+
 static int callback_free(lua_State* L)
 {
     cfunction* p = (cfunction*) lua_touserdata(L, 1);
@@ -1323,8 +1736,9 @@ static int cdata_set(lua_State* L)
     }
 
     push_func_ref(L, *p);
+    lua_rawgeti(L, -1, CALLBACK_FUNC_USR_IDX);
     lua_pushvalue(L, 2);
-    lua_rawseti(L, -2, CALLBACK_FUNC_USR_IDX);
+    lua_rawseti(L, LUA_REGISTRYINDEX, (int) lua_tointeger(L, -2));
 
     /* remove the closure for this callback as it embeds the function pointer
      * value */
@@ -1361,7 +1775,7 @@ static int cdata_call(lua_State* L)
 
     if (!lua_isfunction(L, -1)) {
         lua_pop(L, 1);
-        compile_function(L, *p, -1, &ct);
+        compile_function(L, *p, -1, &ct, NULL);
 
         assert(lua_gettop(L) == top + 2); /* uv, closure */
 
@@ -1369,6 +1783,7 @@ static int cdata_call(lua_State* L)
         lua_pushvalue(L, 1);
         lua_pushvalue(L, -2);
         lua_rawset(L, lua_upvalueindex(1));
+        set_cdata_gc(L, 1);
 
         lua_replace(L, 1);
     } else {
@@ -1398,6 +1813,10 @@ static int ffi_metatype(lua_State* L)
     lua_pushvalue(L, 2);
     lua_rawset(L, 3); /* user[user_mt_key] = mt */
 
+    /* the metatable can't be saved in the cdef cache and would be lost when
+     * loading later cdefs from it */
+    get_jit(L)->cdef_cache_off = 1;
+
     /* return the passed in ctype */
     push_ctype(L, 3, &ct);
     return 1;
@@ -1433,6 +1852,10 @@ static int ffi_gc(lua_State* L)
     lua_pushvalue(L, 2);
     lua_rawset(L, -3);
 
+    if (!lua_isnil(L, 2)) {
+        set_cdata_gc(L, 1);
+    }
+
     /* return the cdata back */
     lua_settop(L, 1);
     return 1;
@@ -1485,14 +1908,186 @@ static ptrdiff_t lookup_cdata_index(lua_State* L, int idx, int ct_usr, struct ct
     }
 }
 
+/* get_scalar_member is the fast path of cdata_index and cdata_newindex for
+ * numeric members of a struct or struct pointer. The member's ctype in the
+ * struct's user value table serves as its descriptor (offset, type and
+ * bitfield info) and is returned in place, without copying it or pushing
+ * user values. *pdata is set to the member's address. Returns NULL if the
+ * general path is needed. */
+static const struct ctype* get_scalar_member(lua_State* L, int idx, int key, char** pdata)
+{
+    const struct cdata* cd = (const struct cdata*) lua_touserdata(L, idx);
+    const struct ctype* ct;
+    const struct ctype* mt;
+
+    if (cd == NULL || lua_type(L, key) != LUA_TSTRING || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+
+    if (!is_metatable(L, -1, &cdata_mt_key)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    lua_pop(L, 1);
+
+    ct = &cd->type;
+    if ((ct->type != STRUCT_TYPE && ct->type != UNION_TYPE) || ct->is_array || ct->pointers > 1 || ct->is_variable_struct) {
+        return NULL;
+    }
+
+    lua_getuservalue(L, idx);
+    lua_pushvalue(L, key);
+    lua_rawget(L, -2);
+    /* the member ctype stays alive in the struct's user value table */
+    mt = (const struct ctype*) lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    if (mt == NULL || mt->pointers || mt->is_array) {
+        return NULL;
+    }
+
+    switch (mt->type) {
+    case BOOL_TYPE:
+    case INT8_TYPE:
+    case INT16_TYPE:
+    case INT32_TYPE:
+    case ENUM_TYPE:
+    case FLOAT_TYPE:
+    case DOUBLE_TYPE:
+        break;
+    default:
+        return NULL;
+    }
+
+    *pdata = ((ct->is_reference || ct->pointers) ? *(char**) (cd+1) : (char*) (cd+1)) + mt->offset;
+
+#ifndef ALLOW_MISALIGNED_ACCESS
+    if (!mt->is_bitfield && ((uintptr_t) *pdata & (mt->base_size - 1))) {
+        return NULL;
+    }
+#endif
+
+    return mt;
+}
+
+/* push_scalar_member pushes the value of a bool, integer up to 32 bits,
+ * enum, float or double member, or a bitfield other than a 64 bit one */
+static int push_scalar_member(lua_State* L, const struct ctype* ct, const char* data)
+{
+    if (ct->is_bitfield) {
+        uint64_t val = *(uint64_t*) data;
+
+        if (ct->type == BOOL_TYPE) {
+            lua_pushboolean(L, (int) (val & (UINT64_C(1) << ct->bit_offset)));
+        } else {
+            val >>= ct->bit_offset;
+            val &= (UINT64_C(1) << ct->bit_size) - 1;
+            lua_pushnumber(L, val);
+        }
+        return 1;
+    }
+
+    switch (ct->type) {
+    case BOOL_TYPE:
+        lua_pushboolean(L, *(_Bool*) data);
+        break;
+    case INT8_TYPE:
+        lua_pushnumber(L, ct->is_unsigned ? (lua_Number) *(uint8_t*) data : (lua_Number) *(int8_t*) data);
+        break;
+    case INT16_TYPE:
+        lua_pushnumber(L, ct->is_unsigned ? (lua_Number) *(uint16_t*) data : (lua_Number) *(int16_t*) data);
+        break;
+    case ENUM_TYPE:
+    case INT32_TYPE:
+        lua_pushnumber(L, ct->is_unsigned ? (lua_Number) *(uint32_t*) data : (lua_Number) *(int32_t*) data);
+        break;
+    case FLOAT_TYPE:
+        lua_pushnumber(L, *(float*) data);
+        break;
+    case DOUBLE_TYPE:
+        lua_pushnumber(L, *(double*) data);
+        break;
+    default:
+        luaL_error(L, "internal error: invalid member type");
+    }
+
+    return 1;
+}
+
+/* set_scalar_member sets a member found by get_scalar_member from a number
+ * or boolean the same as set_value would. Returns 0 if the general path is
+ * needed. */
+static int set_scalar_member(lua_State* L, int idx, const struct ctype* tt, char* to)
+{
+    lua_Number val;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNUMBER:
+        val = lua_tonumber(L, idx);
+        break;
+    case LUA_TBOOLEAN:
+        val = lua_toboolean(L, idx);
+        break;
+    default:
+        return 0;
+    }
+
+    if (tt->is_bitfield || (tt->const_mask & 1)) {
+        return 0;
+    }
+
+    switch (tt->type) {
+    case BOOL_TYPE:
+        *(_Bool*) to = ((int64_t) val != 0);
+        break;
+    case INT8_TYPE:
+        if (tt->is_unsigned) {
+            *(uint8_t*) to = (uint8_t) (uint64_t) val;
+        } else {
+            *(int8_t*) to = (int8_t) (int64_t) val;
+        }
+        break;
+    case INT16_TYPE:
+        if (tt->is_unsigned) {
+            *(uint16_t*) to = (uint16_t) (uint64_t) val;
+        } else {
+            *(int16_t*) to = (int16_t) (int64_t) val;
+        }
+        break;
+    case INT32_TYPE:
+        if (tt->is_unsigned) {
+            *(uint32_t*) to = (uint32_t) (uint64_t) val;
+        } else {
+            *(int32_t*) to = (int32_t) (int64_t) val;
+        }
+        break;
+    case FLOAT_TYPE:
+        *(float*) to = (float) val;
+        break;
+    case DOUBLE_TYPE:
+        *(double*) to = val;
+        break;
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
 static int cdata_newindex(lua_State* L)
 {
+    const struct ctype* mt;
     struct ctype tt;
     char* to;
     ptrdiff_t off;
 
     lua_settop(L, 3);
 
+    mt = get_scalar_member(L, 1, 2, &to);
+    if (mt && set_scalar_member(L, 3, mt, to)) {
+        return 0;
+    }
+
     to = (char*) check_cdata(L, 1, &tt);
     off = lookup_cdata_index(L, 2, -1, &tt);
 
@@ -1528,12 +2123,19 @@ err:
 
 static int cdata_index(lua_State* L)
 {
+    const struct ctype* mt;
     void* to;
     struct ctype ct;
     char* data;
     ptrdiff_t off;
 
     lua_settop(L, 2);
+
+    mt = get_scalar_member(L, 1, 2, &data);
+    if (mt) {
+        return push_scalar_member(L, mt, data);
+    }
+
     data = (char*) check_cdata(L, 1, &ct);
     assert(lua_gettop(L) == 3);
 
@@ -1626,17 +2228,8 @@ err:
 
             return 1;
 
-        } else if (ct.type == BOOL_TYPE) {
-            uint64_t val = *(uint64_t*) data;
-            lua_pushboolean(L, (int) (val & (UINT64_C(1) << ct.bit_offset)));
-            return 1;
-
         } else {
-            uint64_t val = *(uint64_t*) data;
-            val >>= ct.bit_offset;
-            val &= (UINT64_C(1) << ct.bit_size) - 1;
-            lua_pushnumber(L, val);
-            return 1;
+            return push_scalar_member(L, &ct, data);
         }
 
     } else if (ct.pointers) {
@@ -1685,38 +2278,17 @@ err:
 #endif
 
         switch (ct.type) {
-        case BOOL_TYPE:
-            lua_pushboolean(L, *(_Bool*) data);
-            break;
-        case INT8_TYPE:
-            lua_pushnumber(L, ct.is_unsigned ? (lua_Number) *(uint8_t*) data : (lua_Number) *(int8_t*) data);
-            break;
-        case INT16_TYPE:
-            lua_pushnumber(L, ct.is_unsigned ? (lua_Number) *(uint16_t*) data : (lua_Number) *(int16_t*) data);
-            break;
-        case ENUM_TYPE:
-        case INT32_TYPE:
-            lua_pushnumber(L, ct.is_unsigned ? (lua_Number) *(uint32_t*) data : (lua_Number) *(int32_t*) data);
-            break;
         case INT64_TYPE:
             to = push_cdata(L, -1, &ct);
             *(int64_t*) to = *(int64_t*) data;
-            break;
+            return 1;
         case INTPTR_TYPE:
             to = push_cdata(L, -1, &ct);
             *(intptr_t*) to = *(intptr_t*) data;
-            break;
-        case FLOAT_TYPE:
-            lua_pushnumber(L, *(float*) data);
-            break;
-        case DOUBLE_TYPE:
-            lua_pushnumber(L, *(double*) data);
-            break;
+            return 1;
         default:
-            luaL_error(L, "internal error: invalid member type");
+            return push_scalar_member(L, &ct, data);
         }
-
-        return 1;
     }
 }
 
@@ -2679,7 +3251,7 @@ static int cmodule_index(lua_State* L)
     assert(lua_gettop(L) == 3); /* module, name, ct_usr */
 
     if (ct.type == FUNCTION_TYPE) {
-        compile_function(L, (cfunction) sym, -1, &ct);
+        compile_function(L, (cfunction) sym, -1, &ct, lua_tostring(L, 2));
         assert(lua_gettop(L) == 4); /* module, name, ct_usr, function */
 
         /* set module usr value[luaname] = function to cache for next time */
@@ -2783,14 +3355,168 @@ static int cmodule_newindex(lua_State* L)
     return 0;
 }
 
+/* bind_names(lib, names, out) sets out[name] = lib[name] for each name */
+static int bind_names(lua_State* L)
+{
+    int i, n = (int) lua_rawlen(L, 2);
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 2, i);
+        lua_pushcfunction(L, &cmodule_index);
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 1);
+        lua_rawset(L, 3);
+    }
+
+    return 0;
+}
+
+/* ffi.bind(lib, names) looks up and compiles all of the named functions (or
+ * globals) up front, only making the jit pages executable once at the end.
+ * The results are cached in the module as with lib.name, and also returned
+ * in a table of name -> value.
+ */
+static int ffi_bind(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+    int err, writable, restart_gc = 0;
+
+    lua_settop(L, 2);
+
+    if (!lua_getmetatable(L, 1) || !is_metatable(L, -1, &cmodule_mt_key)) {
+        return luaL_argerror(L, 1, "expected a library");
+    }
+    lua_pop(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_newtable(L);
+
+    lua_pushcfunction(L, &bind_names);
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+
+    /* When the pages are mprotected leaving them writable for the batch
+     * means they aren't executable, so a finalizer calling into code on them
+     * would crash. The collector is stopped for the batch, or if we can't
+     * tell whether it's running (lua 5.1) the pages are protected after
+     * each compile as usual. */
+#ifdef LUA_GCISRUNNING
+    writable = 1;
+    if (!jit->exec_off && lua_gc(L, LUA_GCISRUNNING, 0)) {
+        lua_gc(L, LUA_GCSTOP, 0);
+        restart_gc = 1;
+    }
+#else
+    writable = jit->exec_off != 0;
+#endif
+
+    begin_code_batch(jit, writable);
+    err = lua_pcall(L, 3, 0, 0);
+    end_code_batch(jit, writable);
+
+    if (restart_gc) {
+        lua_gc(L, LUA_GCRESTART, 0);
+    }
+
+    if (err) {
+        return lua_error(L);
+    }
+
+    return 1;
+}
+
+/* map_key[function usr] = closure from compile_map */
+static int map_key;
+
+/* ffi.map(fn, n, out, in1, in2, ...) calls fn n times with arguments read
+ * from the input arrays, storing the results in out, all in one call into C.
+ * Returns out. */
+static int ffi_map(lua_State* L)
+{
+    struct ctype ct;
+    const struct ctype* rt;
+    cfunction* pf;
+    int i, top = lua_gettop(L);
+
+    if (lua_iscfunction(L, 1) && lua_getupvalue(L, 1, 1)) {
+        /* functions in libraries are closures with the function cdata as
+         * the first upvalue */
+        lua_replace(L, 1);
+    }
+
+    pf = (cfunction*) to_cdata(L, 1, &ct);
+    if (!pf || ct.pointers || (ct.type != FUNCTION_PTR_TYPE && ct.type != FUNCTION_TYPE)) {
+        return luaL_argerror(L, 1, "expected a C function");
+    }
+
+    /* NULL arrays would crash the thunk, nil is only allowed for the output
+     * of void functions */
+    lua_rawgeti(L, top+1, 0);
+    rt = (const struct ctype*) lua_touserdata(L, -1);
+    i = (!rt->pointers && rt->type == VOID_TYPE) ? 4 : 3;
+    lua_pop(L, 1);
+
+    for (; i <= top; i++) {
+        if (lua_isnil(L, i)) {
+            return luaL_argerror(L, i, "expected an array");
+        }
+    }
+
+    /* the thunk trusts the count, so it must not run past the arrays */
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber(L, 2);
+        if (n < 0 || n != floor(n)) {
+            return luaL_argerror(L, 2, "expected a non-negative integer count");
+        }
+    } else if (check_int64(L, 2) < 0) {
+        return luaL_argerror(L, 2, "expected a non-negative integer count");
+    }
+
+    for (i = 3; i <= top; i++) {
+        struct ctype at;
+        if (to_cdata(L, i, &at) && at.is_array && at.pointers == 1 && !at.is_variable_array
+                && (uint64_t) check_uint64(L, 2) > at.array_size) {
+            return luaL_argerror(L, i, "array is shorter than the count");
+        }
+        lua_pop(L, 1);
+    }
+
+    push_upval(L, &map_key);
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        compile_map(L, top+1, &ct);
+        lua_pushvalue(L, top+1);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, top+2);
+    }
+
+    lua_pushlightuserdata(L, (void*) *pf);
+    lua_replace(L, 1);
+
+    /* out, closure, args */
+    lua_replace(L, top+1);
+    lua_settop(L, top+1);
+    lua_insert(L, 1);
+    lua_pushvalue(L, 4);
+    lua_insert(L, 1);
+    lua_call(L, top, 0);
+    return 1;
+}
+
 static int jit_gc(lua_State* L)
 {
-    size_t i;
     struct jit* jit = get_jit(L);
     dasm_free(jit);
-    for (i = 0; i < jit->pagenum; i++) {
-        FreePage(jit->pages[i], jit->pages[i]->size);
-    }
+    free_gdb_objects(jit);
+    free_code_pages(jit);
+    free_call_queue(jit);
+    free_async_pool(jit);
+    close_perf_map(jit);
     free(jit->globals);
     return 0;
 }
@@ -2802,6 +3528,10 @@ static int ffi_debug(lua_State* L)
     lua_setfield(L, -2, "ctype_mt");
     push_upval(L, &cdata_mt_key);
     lua_setfield(L, -2, "cdata_mt");
+    push_upval(L, &cdata_gc_mt_key);
+    lua_setfield(L, -2, "cdata_gc_mt");
+    push_upval(L, &cdata_large_mt_key);
+    lua_setfield(L, -2, "cdata_large_mt");
     push_upval(L, &cmodule_mt_key);
     lua_setfield(L, -2, "cmodule_mt");
     push_upval(L, &constants_key);
@@ -2820,6 +3550,10 @@ static int ffi_debug(lua_State* L)
     lua_setfield(L, -2, "abi");
     push_upval(L, &next_unnamed_key);
     lua_setfield(L, -2, "next_unnamed");
+    push_upval(L, &thunks_key);
+    lua_setfield(L, -2, "thunks");
+    push_code_stats(L, get_jit(L));
+    lua_setfield(L, -2, "code");
     return 1;
 }
 
@@ -2862,10 +3596,10 @@ static int ffi_u64(lua_State* L)
 { return do64(L, 1); }
 
 static const luaL_Reg cdata_mt[] = {
-    {"__gc", &cdata_gc},
     {"__call", &cdata_call},
     {"free", &cdata_free},
     {"set", &cdata_set},
+    {"async", &ffi_async},
     {"__index", &cdata_index},
     {"__newindex", &cdata_newindex},
     {"__add", &cdata_add},
@@ -2891,6 +3625,20 @@ static const luaL_Reg callback_mt[] = {
     {NULL, NULL}
 };
 
+static const luaL_Reg async_mt[] = {
+    {"ready", &async_ready},
+    {"wait", &async_wait},
+    {"__gc", &async_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg arena_mt[] = {
+    {"new", &arena_new},
+    {"reset", &arena_reset},
+    {"used", &arena_used},
+    {NULL, NULL}
+};
+
 static const luaL_Reg ctype_mt[] = {
     {"__call", &ctype_call},
     {"__new", &ctype_new},
@@ -2912,7 +3660,19 @@ static const luaL_Reg jit_mt[] = {
 static const luaL_Reg ffi_reg[] = {
     {"cdef", &ffi_cdef},
     {"load", &ffi_load},
+    {"bind", &ffi_bind},
+    {"cachedir", &ffi_cachedir},
+    {"map", &ffi_map},
+    {"poll", &ffi_poll},
+    {"async", &ffi_async},
+    {"stats", &ffi_stats},
+    {"perfmap", &ffi_perfmap},
+    {"gdbjit", &ffi_gdbjit},
+    {"jitstats", &ffi_jitstats},
     {"new", &ffi_new},
+    {"alloc", &ffi_alloc},
+    {"largealloc", &ffi_largealloc},
+    {"arena", &ffi_arena},
     {"typeof", &ffi_typeof},
     {"cast", &ffi_cast},
     {"metatype", &ffi_metatype},
@@ -2994,6 +3754,8 @@ static int setup_upvals(lua_State* L)
 #else
         jit->align_page_size = sysconf(_SC_PAGE_SIZE) - 1;
 #endif
+        init_code_pages(jit);
+        jit->function_extern = -1;
         jit->globals = (void**) malloc(64 * sizeof(void*));
         dasm_setupglobal(jit, jit->globals, 64);
         compile_globals(jit, L);
@@ -3249,8 +4011,12 @@ static int setup_upvals(lua_State* L)
     return 0;
 }
 
-static void setup_mt(lua_State* L, const luaL_Reg* mt, int upvals)
+/* setup_mt fills in the metatable below the upvals, tagged for
+ * is_metatable with key */
+static void setup_mt(lua_State* L, int* key, const luaL_Reg* mt, int upvals)
 {
+    lua_pushlightuserdata(L, key);
+    lua_rawseti(L, -upvals-2, MT_TAG_IDX);
     lua_pushboolean(L, 1);
     lua_setfield(L, -upvals-2, "__metatable");
     luaL_setfuncs(L, mt, upvals);
@@ -3263,8 +4029,8 @@ int luaopen_ffi(lua_State* L)
     lua_newtable(L);
     set_upval(L, &niluv_key);
 
-    lua_newtable(L);
-    setup_mt(L, ctype_mt, 0);
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &ctype_mt_key, ctype_mt, 0);
     set_upval(L, &ctype_mt_key);
 
     lua_newtable(L);
@@ -3273,23 +4039,65 @@ int luaopen_ffi(lua_State* L)
     lua_newtable(L);
     set_upval(L, &gc_key);
 
-    lua_newtable(L);
+    lua_createtable(L, 1, 0);
     push_upval(L, &callbacks_key);
     push_upval(L, &gc_key);
-    setup_mt(L, cdata_mt, 2);
+    setup_mt(L, &cdata_mt_key, cdata_mt, 2);
     set_upval(L, &cdata_mt_key);
 
-    lua_newtable(L);
-    setup_mt(L, callback_mt, 0);
+    /* same as cdata_mt with the tag of cdata_mt, plus __gc */
+    lua_createtable(L, 1, 0);
+    push_upval(L, &callbacks_key);
+    push_upval(L, &gc_key);
+    setup_mt(L, &cdata_mt_key, cdata_mt, 2);
+    push_upval(L, &callbacks_key);
+    push_upval(L, &gc_key);
+    lua_pushcclosure(L, &cdata_gc, 2);
+    lua_setfield(L, -2, "__gc");
+    set_upval(L, &cdata_gc_mt_key);
+
+    /* same again with __gc unmapping the data, see ffi.largealloc */
+    lua_createtable(L, 1, 0);
+    push_upval(L, &callbacks_key);
+    push_upval(L, &gc_key);
+    setup_mt(L, &cdata_mt_key, cdata_mt, 2);
+    push_upval(L, &callbacks_key);
+    push_upval(L, &gc_key);
+    lua_pushcclosure(L, &cdata_large_gc, 2);
+    lua_setfield(L, -2, "__gc");
+    set_upval(L, &cdata_large_mt_key);
+
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &callback_mt_key, callback_mt, 0);
     set_upval(L, &callback_mt_key);
 
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &async_mt_key, async_mt, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    set_upval(L, &async_mt_key);
+
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &arena_mt_key, arena_mt, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    set_upval(L, &arena_mt_key);
+
+    /* weak keyed cdata -> arena */
     lua_newtable(L);
-    setup_mt(L, cmodule_mt, 0);
+    lua_newtable(L);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    set_upval(L, &arena_refs_key);
+
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &cmodule_mt_key, cmodule_mt, 0);
     set_upval(L, &cmodule_mt_key);
 
     memset(lua_newuserdata(L, sizeof(struct jit)), 0, sizeof(struct jit));
-    lua_newtable(L);
-    setup_mt(L, jit_mt, 0);
+    lua_createtable(L, 1, 0);
+    setup_mt(L, &jit_key, jit_mt, 0);
     lua_setmetatable(L, -2);
     set_upval(L, &jit_key);
 
@@ -3305,6 +4113,22 @@ int luaopen_ffi(lua_State* L)
     lua_newtable(L);
     set_upval(L, &asmname_key);
 
+    /* weak valued so that shared thunks are freed with their last user */
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    set_upval(L, &thunks_key);
+
+    /* weak keyed so the closures are freed with the function types */
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    set_upval(L, &map_key);
+
     lua_newtable(L);
     set_upval(L, &abi_key);
 
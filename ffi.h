@@ -31,6 +31,8 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include <stddef.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -114,6 +116,13 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
   }
   lua_pop(L, nup);  /* remove upvalues */
 }
+static lua_Number lua_tonumberx(lua_State* L, int idx, int* isnum)
+{
+    if (isnum) {
+        *isnum = lua_isnumber(L, idx);
+    }
+    return lua_tonumber(L, idx);
+}
 #define lua_setuservalue lua_setfenv
 #define lua_getuservalue lua_getfenv
 #define lua_rawlen lua_objlen
@@ -191,6 +200,19 @@ static char* luaL_prepbuffsize(luaL_Buffer* B, size_t sz) {
 #define ALLOW_MISALIGNED_ACCESS
 #endif
 
+/* On linux the jit code is written through a writable mapping of a memfd and
+ * run from a second executable mapping of the same memfd. This removes the
+ * need to mprotect the code pages on each compile. Define
+ * LUA_FFI_NO_DOUBLE_MAP, or set it in the environment, to use the single
+ * mapping + mprotect path instead.
+ */
+#if defined __linux__ && (defined ARCH_X86 || defined ARCH_X64) && !defined LUA_FFI_NO_DOUBLE_MAP
+#include <sys/syscall.h>
+#ifdef SYS_memfd_create
+#define DOUBLE_MAP_CODE
+#endif
+#endif
+
 struct token;
 
 struct parser {
@@ -203,7 +225,35 @@ struct parser {
 struct page {
     size_t size;
     size_t off;
-    size_t freed;
+    size_t live; /* bytes in use by compiled code */
+    size_t last; /* size of the chunk ending at off, see call.c */
+    size_t idx; /* index into jit->pages, unused when pinned */
+    int writable;
+    int pinned; /* in jit->pinned, see call.c */
+};
+
+struct free_chunk;
+
+/* free code chunks are kept in lists by size, each list holds chunks of
+ * CODE_CLASS_SIZE*i to CODE_CLASS_SIZE*(i+1)-1 bytes, except the last which
+ * holds everything larger */
+#define CODE_CLASS_SIZE 64
+#define CODE_SIZE_CLASSES 32
+
+struct code_range {
+    size_t off;
+    size_t size;
+};
+
+/* kinds of code passed to compile in call.c, counted by ffi.jitstats */
+enum {
+    CODE_GLOBALS,
+    CODE_CALL,
+    CODE_VARARG_CALL,
+    CODE_CALLBACK,
+    CODE_MAP,
+    CODE_ASYNC,
+    CODE_KINDS
 };
 
 struct jit {
@@ -212,13 +262,80 @@ struct jit {
     dasm_State* ctx;
     size_t pagenum;
     struct page** pages;
+    struct page* cur_page; /* page new code is appended to */
+    size_t pinnednum;
+    struct page** pinned; /* pages never made writable again, see call.c */
+    void* cur_code; /* jit_head of the code being encoded */
+    struct free_chunk* free_chunks[CODE_SIZE_CLASSES];
+    int batch; /* group gdb registrations until end_code_batch */
+    int batch_writable; /* also defer making pages executable */
     size_t align_page_size;
     void** globals;
     int function_extern;
     void* lua_dll;
     void* kernel32_dll;
+
+    /* when double mapped, pages are allocated from code_rw and are executed
+     * from the same offset in a second mapping exec_off bytes later */
+    ptrdiff_t exec_off;
+    int code_fd;
+    uint8_t* code_rw;
+    size_t code_used;
+    size_t code_filesz;
+    struct code_range* code_free;
+    size_t code_freenum;
+
+    /* cdef cache, see cache.c */
+    uint64_t cdef_hash; /* hash of all cdefs so far */
+    int cdef_busy; /* set while parsing a cdef */
+    int cdef_cache_off;
+    uint64_t cdef_token; /* hash of the last cache file loaded or saved */
+    int cdef_next_id; /* next id to give to a saved table or userdata */
+
+    size_t type_cache_num; /* entries in the check_ctype cache, see ctype.c */
+
+    struct call_queue* queue; /* queued callback calls, see queue.c */
+    struct async_pool* async; /* worker threads for ffi.async, see async.c */
+
+    /* ffi.stats, see stats.c */
+    int stats; /* instrument calls and callbacks compiled from now on */
+    uint64_t stats_tsc; /* tsc and time when first turned on */
+    double stats_time;
+
+    /* ffi.jitstats, see push_code_stats in call.c */
+    size_t code_live; /* number of compiled functions not yet freed */
+    size_t code_freed; /* total bytes of code freed */
+    size_t compiles[CODE_KINDS];
+    double link_time; /* total seconds in dasm_link */
+    double encode_time; /* total seconds in dasm_encode */
+
+    FILE* perf_map; /* see ffi.perfmap in call.c */
+    struct gdbjit* gdb; /* see ffi.gdbjit in gdbjit.c */
+
+    /* ffi.largealloc, see push_cdata in ctype.c */
+    size_t large_threshold; /* 0 when off */
+    int large_huge; /* LARGE_HUGE_* */
 };
 
+/* cdata of at least jit->large_threshold bytes are mapped from the OS and
+ * pushed as a reference, the userdata holding this after the struct cdata.
+ * They have cdata_large_mt which unmaps them when collected. */
+struct large_cdata {
+    void* data;
+    size_t size;
+};
+
+/* options for ffi.largealloc in order */
+enum {
+    LARGE_HUGE_NONE,
+    LARGE_HUGE_MADVISE,
+    LARGE_HUGE_TLB,
+};
+
+/* ffi.largealloc won't map anything smaller than a page */
+#define LARGE_MIN_SIZE 4096
+#define HUGE_PAGE_MASK ((2 << 20) - 1)
+
 #define ALIGN_DOWN(PTR, MASK) \
   (((uintptr_t) (PTR)) & (~ ((uintptr_t) (MASK)) ))
 #define ALIGN_UP(PTR, MASK) \
@@ -228,7 +345,14 @@ struct jit {
 
 #define PTR_ALIGN_MASK (sizeof(void*) - 1)
 #define FUNCTION_ALIGN_MASK (sizeof(void (*)()) - 1)
-#define DEFAULT_ALIGN_MASK 7
+/* __attribute__((aligned(#))) can go up to the page size */
+#define ALIGN_MASK_BITS 12
+#define MAX_ALIGN_MASK ((1 << ALIGN_MASK_BITS) - 1)
+/* no #pragma pack, so only explicit alignments can go past 8 bytes */
+#define DEFAULT_ALIGN_MASK MAX_ALIGN_MASK
+/* cdata with a bigger alignment than lua guarantees for userdata are pushed
+ * as a reference to aligned space later in the userdata */
+#define USERDATA_ALIGN_MASK 7
 
 #ifdef OS_OSX
 /* TODO: figure out why the alignof trick doesn't work on OS X */
@@ -242,8 +366,11 @@ struct jit {
 extern int jit_key;
 extern int ctype_mt_key;
 extern int cdata_mt_key;
+extern int cdata_gc_mt_key;
+extern int cdata_large_mt_key;
 extern int cmodule_mt_key;
 extern int callback_mt_key;
+extern int async_mt_key;
 extern int constants_key;
 extern int types_key;
 extern int gc_key;
@@ -253,8 +380,18 @@ extern int abi_key;
 extern int next_unnamed_key;
 extern int niluv_key;
 extern int asmname_key;
+extern int thunks_key;
+extern int type_cache_key;
+extern int cachedir_key;
+extern int cache_state_key;
+extern int to_define_key;
+extern int g_name_key;
+extern int g_front_name_key;
+extern int g_back_name_key;
 
 int equals_upval(lua_State* L, int idx, int* key);
+int is_metatable(lua_State* L, int idx, int* key);
+#define MT_TAG_IDX 1
 void push_upval(lua_State* L, int* key);
 void set_upval(lua_State* L, int* key);
 struct jit* get_jit(lua_State* L);
@@ -275,6 +412,12 @@ enum {
     FAST_CALL,
 };
 
+/* values of ctype.queued */
+enum {
+    QUEUED_RETURN = 1, /* return zero without waiting for the lua function */
+    QUEUED_WAIT = 2, /* wait for ffi.poll to run the lua function */
+};
+
 enum {
     INVALID_TYPE,
     VOID_TYPE,
@@ -332,7 +475,7 @@ struct ctype {
         size_t variable_increment;
     };
     size_t offset;
-    unsigned align_mask : 4; /* as (align bytes - 1) eg 7 gives 8 byte alignment */
+    unsigned align_mask : ALIGN_MASK_BITS; /* as (align bytes - 1) eg 7 gives 8 byte alignment */
     unsigned pointers : POINTER_BITS; /* number of dereferences to get to the base type including +1 for arrays */
     unsigned const_mask : POINTER_MAX + 1; /* const pointer mask, LSB is current pointer, +1 for the whether the base type is const */
     unsigned type : 5; /* value given by type enum above */
@@ -343,6 +486,8 @@ struct ctype {
     unsigned has_member_name : 1;
     unsigned calling_convention : 2;
     unsigned has_var_arg : 1;
+    unsigned no_errno : 1; /* calls don't need to save/restore errno */
+    unsigned queued : 2; /* QUEUED_* for callbacks called from other threads */
     unsigned is_variable_array : 1; /* set for variable array types where we don't know the variable size yet */
     unsigned is_variable_struct : 1;
     unsigned variable_size_known : 1; /* used for variable structs after we know the variable size */
@@ -366,6 +511,29 @@ struct cdata {
 
 typedef void (*cfunction)(void);
 
+/* Variadic function calls record the lua types of the variadic arguments
+ * and once a combination has been seen VARARG_WARMUP times a thunk
+ * specialized for it is compiled. VARARG_* are the chars used to describe the
+ * specialized arguments. */
+#define VARARG_WARMUP 64
+#define VARARG_MAX_ARGS 14
+#define VARARG_SPECIALIZED 4
+#define VARARG_SEEN 8
+
+#define VARARG_NUMBER 'n'
+#define VARARG_BOOL 'b'
+#define VARARG_POINTER 'p'
+
+struct vararg_site {
+    cfunction generic;
+    int nfixed;
+    size_t specnum;
+    int spec_keys[VARARG_SPECIALIZED];
+    cfunction spec[VARARG_SPECIALIZED];
+    int seen_keys[VARARG_SEEN];
+    int seen_count[VARARG_SEEN];
+};
+
 #ifdef HAVE_COMPLEX
 typedef double complex complex_double;
 typedef float complex complex_float;
@@ -394,12 +562,56 @@ static float cimagf(complex_float c) {
 #endif
 
 #define CALLBACK_FUNC_USR_IDX 1
+#define CALLBACK_TYPE_USR_IDX 0 /* function usr table, queued callbacks only */
+#define CALLBACK_QUEUED_USR_IDX -1 /* id, queued callbacks only, see queue.c */
+
+/* Calls to queued callbacks from threads other than the one that owns the
+ * lua_State are copied into a ring of these, see queue.c. Arguments and the
+ * return value are stored by type: 32 bit and smaller ints as i32/u32,
+ * floats and doubles as d. */
+#define QUEUE_SIZE 1024
+#define QUEUE_MAX_ARGS 14
+
+union queued_value {
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+    double d;
+    void* p;
+};
+
+struct queued_call {
+    volatile size_t seq;
+    volatile int done;
+    int wait;
+    int id; /* id of the callback, see queue.c */
+    union queued_value ret;
+    union queued_value args[QUEUE_MAX_ARGS];
+};
+
+struct call_queue;
+struct async_pool;
+struct gdbjit;
+struct gdb_code;
+
+/* counters updated by the code for calls and callbacks compiled while
+ * ffi.stats is on, the offsets are used in call_x86.dasc */
+struct call_stats {
+    uint64_t calls;
+    uint64_t ticks; /* total rdtsc ticks */
+    uint64_t max; /* longest call in ticks */
+};
 
 void set_defined(lua_State* L, int ct_usr, struct ctype* ct);
+void update_on_definition(lua_State* L, int ct_usr, int ct_idx);
+void set_value(lua_State* L, int idx, void* to, int to_usr, const struct ctype* tt, int check_pointers);
 struct ctype* push_ctype(lua_State* L, int ct_usr, const struct ctype* ct);
 void* push_cdata(lua_State* L, int ct_usr, const struct ctype* ct); /* called from asm */
+void* push_uninit_cdata(lua_State* L, int ct_usr, const struct ctype* ct);
 void push_callback(lua_State* L, cfunction f);
 void check_ctype(lua_State* L, int idx, struct ctype* ct);
+void clear_type_cache(lua_State* L);
 void* to_cdata(lua_State* L, int idx, struct ctype* ct);
 void* check_cdata(lua_State* L, int idx, struct ctype* ct);
 size_t ctype_size(lua_State* L, const struct ctype* ct);
@@ -411,13 +623,46 @@ void push_type_name(lua_State* L, int usr, const struct ctype* ct);
 int push_user_mt(lua_State* L, int ct_usr, const struct ctype* ct);
 
 int ffi_cdef(lua_State* L);
+int ffi_cachedir(lua_State* L);
+int cdef_cache_begin(lua_State* L, const char* text, size_t sz);
+void cdef_cache_end(lua_State* L);
 
 void push_func_ref(lua_State* L, cfunction func);
 void free_code(struct jit* jit, lua_State* L, cfunction func);
+void init_code_pages(struct jit* jit);
+void free_code_pages(struct jit* jit);
+void push_code_stats(lua_State* L, struct jit* jit);
+int ffi_jitstats(lua_State* L);
+void begin_code_batch(struct jit* jit, int writable);
+void end_code_batch(struct jit* jit, int writable);
 int x86_return_size(lua_State* L, int usr, const struct ctype* ct);
-void compile_function(lua_State* L, cfunction f, int ct_usr, const struct ctype* ct);
+void compile_function(lua_State* L, cfunction f, int ct_usr, const struct ctype* ct, const char* name);
+cfunction compile_vararg_function(lua_State* L, int ct_usr, const struct ctype* ct, const char* varargs);
+void compile_map(lua_State* L, int ct_usr, const struct ctype* ct);
+cfunction compile_packed_call(lua_State* L, int ct_usr, const struct ctype* ct);
+int call_vararg(lua_State* L);
 cfunction compile_callback(lua_State* L, int fidx, int ct_usr, const struct ctype* ct);
 void compile_globals(struct jit* jit, lua_State* L);
+struct call_queue* get_call_queue(lua_State* L);
+void free_call_queue(struct jit* jit);
+int add_queued_callback(lua_State* L);
+void cancel_queued_calls(lua_State* L, int idx);
+int ffi_poll(lua_State* L);
+void free_async_pool(struct jit* jit);
+int ffi_async(lua_State* L);
+struct call_stats* push_call_stats(lua_State* L, int ct_usr, const struct ctype* ct, const char* name, int callback);
+int ffi_stats(lua_State* L);
+double get_time(void);
+int ffi_perfmap(lua_State* L);
+void close_perf_map(struct jit* jit);
+int ffi_gdbjit(lua_State* L);
+struct gdb_code* add_gdb_code(struct jit* jit, void* addr, size_t size, const char* name);
+void free_gdb_code(struct jit* jit, struct gdb_code* c);
+void flush_gdb_code(struct jit* jit);
+void free_gdb_objects(struct jit* jit);
+int async_ready(lua_State* L);
+int async_wait(lua_State* L);
+int async_gc(lua_State* L);
 int get_extern(struct jit* jit, uint8_t* addr, int idx, int type);
 
 /* WARNING: assembly needs to be updated for prototype changes of these functions */
@@ -437,12 +682,16 @@ cfunction check_typed_cfunction(lua_State* L, int idx, int to_usr, const struct
 complex_double check_complex_double(lua_State* L, int idx);
 complex_float check_complex_float(lua_State* L, int idx);
 
+struct queued_call* queue_reserve(struct call_queue* q, int id, int wait);
+void queue_commit(struct queued_call* c, union queued_value* ret);
+
 void unpack_varargs_stack(lua_State* L, int first, int last, char* to);
 void unpack_varargs_reg(lua_State* L, int first, int last, char* to);
 
 void unpack_varargs_stack_skip(lua_State* L, int first, int last, int ints_to_skip, int floats_to_skip, char* to);
 void unpack_varargs_float(lua_State* L, int first, int last, int max, char* to);
 void unpack_varargs_int(lua_State* L, int first, int last, int max, char* to);
+void* check_vararg_pointer(lua_State* L, int idx);
 
 
 
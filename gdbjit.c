@@ -0,0 +1,683 @@
+/* vim: ts=4 sw=4 sts=4 et tw=78
+ * Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+ */
+#include "ffi.h"
+
+/* While ffi.gdbjit is on, the code compiled for calls, callbacks, etc is
+ * registered with gdb's JIT interface (see "JIT Compilation Interface" in
+ * the gdb manual) so that debuggers can name it and unwind through it. Each
+ * registration is a small in memory ELF object with a symbol and an
+ * .eh_frame FDE for each function. The text section is SHT_NOBITS at the
+ * address of the code so the code isn't copied.
+ *
+ * Building and registering an object for each function would slow down
+ * ffi.bind, which compiles many functions in one code batch. So functions
+ * compiled inside a batch are kept in the pending list and registered as one
+ * object when the batch ends. An object is unregistered and freed once all
+ * of its functions have been freed.
+ *
+ * All of the generated functions start with push rbp; mov rbp, rsp, which is
+ * described exactly by the FDE. Code that doesn't (the globals) is jumped to
+ * from inside a function's frame and is described by the rbp based rule for
+ * its whole length. The CFA is off by a word on the final ret, as in most
+ * JITs.
+ */
+
+#if defined __ELF__ && (defined __amd64__ || defined __i386__)
+#include <pthread.h>
+
+enum {
+    JIT_NOACTION,
+    JIT_REGISTER_FN,
+    JIT_UNREGISTER_FN
+};
+
+struct jit_code_entry {
+    struct jit_code_entry* next_entry;
+    struct jit_code_entry* prev_entry;
+    const char* symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry* relevant_entry;
+    struct jit_code_entry* first_entry;
+};
+
+/* gdb sets a breakpoint on __jit_debug_register_code and reads
+ * __jit_debug_descriptor, so these must be exported with these names. If
+ * another library in the process (eg luajit) also defines them, the dynamic
+ * linker binds ours to theirs and the list is shared. */
+EXPORT struct jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, NULL, NULL};
+
+EXPORT void __attribute__((noinline)) __jit_debug_register_code(void)
+{
+    __asm__ __volatile__ ("");
+}
+
+/* the list is shared by all lua_States in the process */
+static pthread_mutex_t gdb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct gdb_code {
+    uint8_t* addr; /* NULL once freed */
+    size_t size;
+    int prologue; /* starts with push rbp; mov rbp, rsp */
+    char* name; /* only needed until the object is built */
+    struct gdb_object* obj; /* NULL while pending */
+};
+
+struct gdb_object {
+    struct jit_code_entry entry;
+    struct jit* jit;
+    /* objects of the jit, the gdb list may include other libraries' */
+    struct gdb_object* next;
+    struct gdb_object* prev;
+    size_t live;
+    size_t num;
+    struct gdb_code** code;
+    uint8_t* elf;
+};
+
+struct gdbjit {
+    int on;
+    struct gdb_object* objects;
+    struct gdb_code** pending;
+    size_t pendingnum;
+    size_t pendingsz;
+};
+
+#ifdef __amd64__
+#define ELF_CLASS 2
+#define ELF_MACHINE 62 /* EM_X86_64 */
+#define DW_REG_SP 7
+#define DW_REG_FP 6
+#define DW_REG_RA 16
+static const uint8_t prologue[] = {0x55, 0x48, 0x89, 0xE5};
+#else
+#define ELF_CLASS 1
+#define ELF_MACHINE 3 /* EM_386 */
+#define DW_REG_SP 4
+#define DW_REG_FP 5
+#define DW_REG_RA 8
+static const uint8_t prologue[] = {0x55, 0x89, 0xE5};
+#endif
+
+/* the ELF32 and ELF64 headers only differ in the size of the address
+ * fields */
+struct elf_header {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uintptr_t entry;
+    uintptr_t phoff;
+    uintptr_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+};
+
+struct elf_section {
+    uint32_t name;
+    uint32_t type;
+    uintptr_t flags;
+    uintptr_t addr;
+    uintptr_t offset;
+    uintptr_t size;
+    uint32_t link;
+    uint32_t info;
+    uintptr_t addralign;
+    uintptr_t entsize;
+};
+
+struct elf_symbol {
+#ifdef __amd64__
+    uint32_t name;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+    uint64_t value;
+    uint64_t size;
+#else
+    uint32_t name;
+    uint32_t value;
+    uint32_t size;
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+#endif
+};
+
+enum {
+    SECT_NULL,
+    SECT_TEXT,
+    SECT_EH_FRAME,
+    SECT_SHSTRTAB,
+    SECT_STRTAB,
+    SECT_SYMTAB,
+    SECT_NUM
+};
+
+static const char section_names[] = "\0.text\0.eh_frame\0.shstrtab\0.strtab\0.symtab";
+static const uint32_t section_name_offs[SECT_NUM] = {0, 1, 7, 17, 27, 35};
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_NOBITS 8
+#define SHF_ALLOC 2
+#define SHF_EXECINSTR 4
+
+#define DW_CFA_advance_loc 0x40
+#define DW_CFA_offset 0x80
+#define DW_CFA_def_cfa 0x0C
+#define DW_CFA_def_cfa_register 0x0D
+#define DW_CFA_def_cfa_offset 0x0E
+#define DW_EH_PE_udata4 0x03
+#define DW_EH_PE_textrel 0x20
+
+struct buffer {
+    uint8_t* data;
+    size_t size;
+    size_t cap;
+    int err;
+};
+
+/* put appends n bytes from p, or zeros if p is NULL, and returns the offset
+ * they were put at */
+static size_t put(struct buffer* b, const void* p, size_t n)
+{
+    size_t off = b->size;
+
+    if (b->size + n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        uint8_t* data;
+        while (cap < b->size + n) {
+            cap *= 2;
+        }
+        data = (uint8_t*) realloc(b->data, cap);
+        if (data == NULL) {
+            b->err = 1;
+            return 0;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+
+    if (p) {
+        memcpy(b->data + off, p, n);
+    } else {
+        memset(b->data + off, 0, n);
+    }
+    b->size += n;
+    return off;
+}
+
+static void put_u8(struct buffer* b, uint8_t v)
+{
+    put(b, &v, 1);
+}
+
+static void put_u32(struct buffer* b, uint32_t v)
+{
+    put(b, &v, 4);
+}
+
+/* pad_to aligns the buffer with fill bytes, DW_CFA_nop is 0 */
+static void pad_to(struct buffer* b, size_t align)
+{
+    while (!b->err && b->size % align) {
+        put_u8(b, 0);
+    }
+}
+
+/* set_length fills in the length field at off of a CIE or FDE */
+static void set_length(struct buffer* b, size_t off)
+{
+    if (!b->err) {
+        uint32_t len = (uint32_t) (b->size - off - 4);
+        memcpy(b->data + off, &len, 4);
+    }
+}
+
+/* All of the values we need fit in one byte of (s)uleb128. */
+static void put_eh_frame(struct buffer* b, struct gdb_code** code, size_t num, uint8_t* lo)
+{
+    size_t i, cie = b->size;
+
+    put_u32(b, 0); /* length */
+    put_u32(b, 0); /* CIE id */
+    put_u8(b, 1); /* version */
+    put(b, "zR", 3);
+    put_u8(b, 1); /* code alignment */
+    put_u8(b, (uint8_t) (0x80 - sizeof(void*))); /* data alignment -sizeof(void*) */
+    put_u8(b, DW_REG_RA);
+    put_u8(b, 1); /* augmentation length */
+    put_u8(b, DW_EH_PE_textrel | DW_EH_PE_udata4);
+    put_u8(b, DW_CFA_def_cfa);
+    put_u8(b, DW_REG_SP);
+    put_u8(b, sizeof(void*));
+    put_u8(b, DW_CFA_offset | DW_REG_RA);
+    put_u8(b, 1);
+    pad_to(b, sizeof(void*));
+    set_length(b, cie);
+
+    for (i = 0; i < num; i++) {
+        size_t fde = b->size;
+
+        if (code[i]->addr == NULL) {
+            continue;
+        }
+
+        put_u32(b, 0); /* length */
+        put_u32(b, (uint32_t) (b->size - cie)); /* CIE pointer */
+        put_u32(b, (uint32_t) (code[i]->addr - lo));
+        put_u32(b, (uint32_t) code[i]->size);
+        put_u8(b, 0); /* augmentation length */
+
+        if (code[i]->prologue) {
+            /* push rbp */
+            put_u8(b, DW_CFA_advance_loc | 1);
+            put_u8(b, DW_CFA_def_cfa_offset);
+            put_u8(b, 2 * sizeof(void*));
+            put_u8(b, DW_CFA_offset | DW_REG_FP);
+            put_u8(b, 2);
+            /* mov rbp, rsp */
+            put_u8(b, DW_CFA_advance_loc | (sizeof(prologue) - 1));
+            put_u8(b, DW_CFA_def_cfa_register);
+            put_u8(b, DW_REG_FP);
+        } else {
+            put_u8(b, DW_CFA_def_cfa);
+            put_u8(b, DW_REG_FP);
+            put_u8(b, 2 * sizeof(void*));
+            put_u8(b, DW_CFA_offset | DW_REG_FP);
+            put_u8(b, 2);
+        }
+
+        pad_to(b, sizeof(void*));
+        set_length(b, fde);
+    }
+
+    put_u32(b, 0); /* terminator */
+}
+
+/* build_object builds the ELF object for the code between lo and hi */
+static uint8_t* build_object(struct gdb_code** code, size_t num, uint8_t* lo, uint8_t* hi, size_t* psize)
+{
+    struct buffer b = {NULL, 0, 0, 0};
+    struct elf_header* hdr;
+    struct elf_section* sect;
+    size_t i, shoff, shstrtab, strtab, strtabsz, symtab, symtabsz, eh_frame;
+    uint32_t name;
+
+    put(&b, NULL, sizeof(struct elf_header));
+    shoff = put(&b, NULL, SECT_NUM * sizeof(struct elf_section));
+    shstrtab = put(&b, section_names, sizeof(section_names));
+
+    strtab = put(&b, "", 1);
+    for (i = 0; i < num; i++) {
+        if (code[i]->addr) {
+            put(&b, code[i]->name, strlen(code[i]->name) + 1);
+        }
+    }
+    strtabsz = b.size - strtab;
+
+    pad_to(&b, sizeof(void*));
+    symtab = put(&b, NULL, sizeof(struct elf_symbol));
+    name = 1;
+    for (i = 0; i < num; i++) {
+        struct elf_symbol sym;
+
+        if (code[i]->addr == NULL) {
+            continue;
+        }
+
+        memset(&sym, 0, sizeof(sym));
+        sym.name = name;
+        sym.info = (1 << 4) | 2; /* STB_GLOBAL, STT_FUNC */
+        sym.shndx = SECT_TEXT;
+        sym.value = (uintptr_t) (code[i]->addr - lo);
+        sym.size = code[i]->size;
+        put(&b, &sym, sizeof(sym));
+        name += (uint32_t) strlen(code[i]->name) + 1;
+    }
+    symtabsz = b.size - symtab;
+
+    pad_to(&b, sizeof(void*));
+    eh_frame = b.size;
+    put_eh_frame(&b, code, num, lo);
+
+    if (b.err) {
+        free(b.data);
+        return NULL;
+    }
+
+    hdr = (struct elf_header*) b.data;
+    memcpy(hdr->ident, "\x7F" "ELF", 4);
+    hdr->ident[4] = ELF_CLASS;
+    hdr->ident[5] = 1; /* little endian */
+    hdr->ident[6] = 1; /* version */
+    hdr->type = 1; /* ET_REL */
+    hdr->machine = ELF_MACHINE;
+    hdr->version = 1;
+    hdr->shoff = shoff;
+    hdr->ehsize = sizeof(struct elf_header);
+    hdr->shentsize = sizeof(struct elf_section);
+    hdr->shnum = SECT_NUM;
+    hdr->shstrndx = SECT_SHSTRTAB;
+
+    sect = (struct elf_section*) (b.data + shoff);
+    for (i = 0; i < SECT_NUM; i++) {
+        sect[i].name = section_name_offs[i];
+    }
+
+    sect[SECT_TEXT].type = SHT_NOBITS;
+    sect[SECT_TEXT].flags = SHF_ALLOC | SHF_EXECINSTR;
+    sect[SECT_TEXT].addr = (uintptr_t) lo;
+    sect[SECT_TEXT].size = hi - lo;
+    sect[SECT_TEXT].addralign = 16;
+
+    sect[SECT_EH_FRAME].type = SHT_PROGBITS;
+    sect[SECT_EH_FRAME].flags = SHF_ALLOC;
+    sect[SECT_EH_FRAME].offset = eh_frame;
+    sect[SECT_EH_FRAME].size = b.size - eh_frame;
+    sect[SECT_EH_FRAME].addralign = sizeof(void*);
+
+    sect[SECT_SHSTRTAB].type = SHT_STRTAB;
+    sect[SECT_SHSTRTAB].offset = shstrtab;
+    sect[SECT_SHSTRTAB].size = sizeof(section_names);
+    sect[SECT_SHSTRTAB].addralign = 1;
+
+    sect[SECT_STRTAB].type = SHT_STRTAB;
+    sect[SECT_STRTAB].offset = strtab;
+    sect[SECT_STRTAB].size = strtabsz;
+    sect[SECT_STRTAB].addralign = 1;
+
+    sect[SECT_SYMTAB].type = SHT_SYMTAB;
+    sect[SECT_SYMTAB].offset = symtab;
+    sect[SECT_SYMTAB].size = symtabsz;
+    sect[SECT_SYMTAB].link = SECT_STRTAB;
+    sect[SECT_SYMTAB].info = 1; /* index of the first global symbol */
+    sect[SECT_SYMTAB].addralign = sizeof(void*);
+    sect[SECT_SYMTAB].entsize = sizeof(struct elf_symbol);
+
+    *psize = b.size;
+    return b.data;
+}
+
+static void free_object(struct gdb_object* obj)
+{
+    size_t i;
+    struct gdbjit* g = obj->jit->gdb;
+    if (obj->prev) {
+        obj->prev->next = obj->next;
+    } else if (g->objects == obj) {
+        g->objects = obj->next;
+    }
+    if (obj->next) {
+        obj->next->prev = obj->prev;
+    }
+    for (i = 0; i < obj->num; i++) {
+        free(obj->code[i]);
+    }
+    free(obj->code);
+    free(obj->elf);
+    free(obj);
+}
+
+static void register_object(struct gdb_object* obj)
+{
+    struct jit_code_entry* e = &obj->entry;
+
+    pthread_mutex_lock(&gdb_lock);
+    e->prev_entry = NULL;
+    e->next_entry = __jit_debug_descriptor.first_entry;
+    if (e->next_entry) {
+        e->next_entry->prev_entry = e;
+    }
+    __jit_debug_descriptor.first_entry = e;
+    __jit_debug_descriptor.relevant_entry = e;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    pthread_mutex_unlock(&gdb_lock);
+}
+
+/* unregister_object must be called with gdb_lock held */
+static void unregister_object(struct gdb_object* obj)
+{
+    struct jit_code_entry* e = &obj->entry;
+
+    if (e->prev_entry) {
+        e->prev_entry->next_entry = e->next_entry;
+    } else {
+        __jit_debug_descriptor.first_entry = e->next_entry;
+    }
+    if (e->next_entry) {
+        e->next_entry->prev_entry = e->prev_entry;
+    }
+    __jit_debug_descriptor.relevant_entry = e;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+}
+
+/* add_object builds and registers an object for code. On failure the code
+ * is left without debug info. */
+static void add_object(struct jit* jit, struct gdb_code** code, size_t num, uint8_t* lo, uint8_t* hi)
+{
+    struct gdb_object* obj = (struct gdb_object*) calloc(1, sizeof(struct gdb_object));
+    size_t i, size = 0;
+
+    if (obj) {
+        obj->jit = jit;
+        obj->code = (struct gdb_code**) malloc(num * sizeof(struct gdb_code*));
+        obj->elf = build_object(code, num, lo, hi, &size);
+    }
+
+    for (i = 0; i < num; i++) {
+        free(code[i]->name);
+        code[i]->name = NULL;
+
+        if (code[i]->addr == NULL) {
+            free(code[i]);
+        } else if (obj && obj->code && obj->elf) {
+            code[i]->obj = obj;
+            obj->code[obj->num++] = code[i];
+            obj->live++;
+        } else {
+            /* free_gdb_code frees code without an object */
+            code[i]->addr = NULL;
+        }
+    }
+
+    if (obj && obj->code && obj->elf && obj->live) {
+        obj->next = jit->gdb->objects;
+        if (obj->next) {
+            obj->next->prev = obj;
+        }
+        jit->gdb->objects = obj;
+        obj->entry.symfile_addr = (const char*) obj->elf;
+        obj->entry.symfile_size = size;
+        register_object(obj);
+    } else if (obj) {
+        free_object(obj);
+    }
+}
+
+/* flush_gdb_code registers the pending code. Code further apart than the
+ * 32 bit offsets in the FDEs can reach is split into multiple objects. */
+void flush_gdb_code(struct jit* jit)
+{
+    struct gdbjit* g = jit->gdb;
+    size_t i, begin = 0;
+    uint8_t *lo = NULL, *hi = NULL;
+
+    if (g == NULL || g->pendingnum == 0) {
+        return;
+    }
+
+    for (i = 0; i < g->pendingnum; i++) {
+        uint8_t* addr = g->pending[i]->addr;
+        uint8_t* end = addr + g->pending[i]->size;
+
+        if (addr == NULL) {
+            continue;
+        }
+
+        if (lo && (uint64_t) ((end > hi ? end : hi) - (addr < lo ? addr : lo)) > UINT32_MAX) {
+            add_object(jit, g->pending + begin, i - begin, lo, hi);
+            begin = i;
+            lo = hi = NULL;
+        }
+
+        if (lo == NULL || addr < lo) {
+            lo = addr;
+        }
+        if (hi == NULL || end > hi) {
+            hi = end;
+        }
+    }
+
+    add_object(jit, g->pending + begin, g->pendingnum - begin, lo, hi);
+    g->pendingnum = 0;
+}
+
+/* add_gdb_code adds the code at addr to be registered, straight away
+ * unless we are in a code batch. It returns the gdb_code to be passed to
+ * free_gdb_code when the code is freed, or NULL if ffi.gdbjit is off. */
+struct gdb_code* add_gdb_code(struct jit* jit, void* addr, size_t size, const char* name)
+{
+    struct gdbjit* g = jit->gdb;
+    struct gdb_code* c;
+
+    if (g == NULL || !g->on) {
+        return NULL;
+    }
+
+    if (g->pendingnum == g->pendingsz) {
+        size_t sz = g->pendingsz ? g->pendingsz * 2 : 16;
+        struct gdb_code** p = (struct gdb_code**) realloc(g->pending, sz * sizeof(struct gdb_code*));
+        if (p == NULL) {
+            return NULL;
+        }
+        g->pending = p;
+        g->pendingsz = sz;
+    }
+
+    c = (struct gdb_code*) calloc(1, sizeof(struct gdb_code));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->name = (char*) malloc(strlen(name) + 1);
+    if (c->name == NULL) {
+        free(c);
+        return NULL;
+    }
+
+    strcpy(c->name, name);
+    c->addr = (uint8_t*) addr;
+    c->size = size;
+    c->prologue = size >= sizeof(prologue) && !memcmp(addr, prologue, sizeof(prologue));
+    g->pending[g->pendingnum++] = c;
+
+    if (!jit->batch) {
+        flush_gdb_code(jit);
+    }
+
+    return c;
+}
+
+/* free_gdb_code is called as the code of c is freed */
+void free_gdb_code(struct jit* jit, struct gdb_code* c)
+{
+    struct gdb_object* obj = c->obj;
+
+    if (c->addr && obj == NULL) {
+        /* still pending, freed by flush_gdb_code */
+        c->addr = NULL;
+        return;
+    }
+
+    if (obj == NULL) {
+        free(c);
+        return;
+    }
+
+    c->addr = NULL;
+    if (--obj->live == 0) {
+        pthread_mutex_lock(&gdb_lock);
+        unregister_object(obj);
+        pthread_mutex_unlock(&gdb_lock);
+        free_object(obj);
+    }
+}
+
+/* free_gdb_objects unregisters all of the code of the jit as its pages are
+ * freed */
+void free_gdb_objects(struct jit* jit)
+{
+    struct gdbjit* g = jit->gdb;
+    size_t i;
+
+    if (g == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&gdb_lock);
+    while (g->objects) {
+        struct gdb_object* obj = g->objects;
+        unregister_object(obj);
+        free_object(obj);
+    }
+    pthread_mutex_unlock(&gdb_lock);
+
+    for (i = 0; i < g->pendingnum; i++) {
+        free(g->pending[i]->name);
+        free(g->pending[i]);
+    }
+    free(g->pending);
+    free(g);
+    jit->gdb = NULL;
+}
+
+/* ffi.gdbjit(on) turns on or off registering the code compiled from then
+ * on with gdb */
+int ffi_gdbjit(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+
+    if (jit->gdb == NULL) {
+        jit->gdb = (struct gdbjit*) calloc(1, sizeof(struct gdbjit));
+        if (jit->gdb == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+    }
+
+    jit->gdb->on = lua_toboolean(L, 1);
+    return 0;
+}
+
+#else
+int ffi_gdbjit(lua_State* L)
+{
+    return luaL_error(L, "NYI: ffi.gdbjit on this platform");
+}
+
+void flush_gdb_code(struct jit* jit)
+{}
+
+struct gdb_code* add_gdb_code(struct jit* jit, void* addr, size_t size, const char* name)
+{ return NULL; }
+
+void free_gdb_code(struct jit* jit, struct gdb_code* c)
+{}
+
+void free_gdb_objects(struct jit* jit)
+{}
+#endif
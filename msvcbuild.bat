@@ -41,7 +41,7 @@ rem This the name of the dll that can be handed to LoadLibrary. This should not
 "%LUA_EXE%" dynasm\dynasm.lua -LNE -D X64 -o call_x64.h call_x86.dasc
 "%LUA_EXE%" dynasm\dynasm.lua -LNE -D X64 -D X64WIN -o call_x64win.h call_x86.dasc
 "%LUA_EXE%" dynasm\dynasm.lua -LNE -o call_arm.h call_arm.dasc
-%DO_CL% /I"." /I"%LUA_INCLUDE%" /DLUA_DLL_NAME="%LUA_DLL%" call.c ctype.c ffi.c parser.c
+%DO_CL% /I"." /I"%LUA_INCLUDE%" /DLUA_DLL_NAME="%LUA_DLL%" cache.c call.c ctype.c ffi.c parser.c queue.c async.c stats.c gdbjit.c
 %DO_LINK% /DLL /OUT:ffi.dll "%LUA_LIB%" *.obj
 if exist ffi.dll.manifest^
     %DO_MT% -manifest ffi.dll.manifest -outputresource:"ffi.dll;2"
@@ -234,9 +234,9 @@ static void put_back(struct parser* P)
 
 int64_t calculate_constant(lua_State* L, struct parser* P);
 
-static int g_name_key;
-static int g_front_name_key;
-static int g_back_name_key;
+int g_name_key;
+int g_front_name_key;
+int g_back_name_key;
 
 #ifndef max
 #define max(a,b) ((a) < (b) ? (b) : (a))
@@ -694,6 +694,12 @@ static void instantiate_typedef(struct parser* P, struct ctype* tt, const struct
     tt->const_mask |= pt.const_mask;
     tt->is_packed = pt.is_packed;
 
+    /* function attributes before the return type */
+    tt->no_errno |= pt.no_errno;
+    if (pt.queued) {
+        tt->queued = pt.queued;
+    }
+
     if (tt->is_packed) {
         tt->align_mask = 0;
     } else {
@@ -705,6 +711,8 @@ static void instantiate_typedef(struct parser* P, struct ctype* tt, const struct
     }
 }
 
+static int parse_attribute(lua_State* L, struct parser* P, struct token* tok, struct ctype* ct, struct parser* asmname);
+
 /* this parses a struct or union starting with the optional
  * name before the opening brace
  * leaves the type usr value on the stack
@@ -716,6 +724,11 @@ static int parse_record(lua_State* L, struct parser* P, struct ctype* ct)
 
     require_token(L, P, &tok);
 
+    /* e.g. struct __attribute__((aligned(64))) foo {...} */
+    while (parse_attribute(L, P, &tok, ct, NULL)) {
+        require_token(L, P, &tok);
+    }
+
     /* name is optional */
     if (tok.type == TOK_TOKEN) {
         /* declaration */
@@ -823,6 +836,16 @@ static int parse_record(lua_State* L, struct parser* P, struct ctype* ct)
          */
         lua_newtable(L);
         parse_struct(L, P, -1, ct);
+
+        /* attributes after the close curly belong to the struct
+         * e.g. struct foo {...} __attribute__((aligned(64))) */
+        while (next_token(L, P, &tok)) {
+            if (!parse_attribute(L, P, &tok, ct, NULL)) {
+                put_back(P);
+                break;
+            }
+        }
+
         calculate_struct_offsets(L, P, -2, ct, -1);
         assert(lua_gettop(L) == top + 2 && lua_istable(L, -1));
         lua_pop(L, 1);
@@ -1035,16 +1058,12 @@ static int parse_attribute(lua_State* L, struct parser* P, struct token* tok, st
                         luaL_error(L, "expected align(#) on line %d", P->line);
                     }
 
-                    switch (tok->integer) {
-                    case 1: align = 0; break;
-                    case 2: align = 1; break;
-                    case 4: align = 3; break;
-                    case 8: align = 7; break;
-                    case 16: align = 15; break;
-                    default:
+                    if (tok->integer < 1 || tok->integer > MAX_ALIGN_MASK + 1 || (tok->integer & (tok->integer - 1))) {
                         luaL_error(L, "unsupported align size on line %d", P->line);
                     }
 
+                    align = (unsigned) (tok->integer - 1);
+
                     check_token(L, P, TOK_CLOSE_PAREN, NULL, "expected align(#) on line %d", P->line);
                     break;
 
@@ -1138,6 +1157,19 @@ static int parse_attribute(lua_State* L, struct parser* P, struct token* tok, st
 
             } else if (IS_LITERAL(*tok, "stdcall") || IS_LITERAL(*tok, "__stdcall__")) {
                 ct->calling_convention = STD_CALL;
+
+            } else if (IS_LITERAL(*tok, "pure") || IS_LITERAL(*tok, "__pure__")
+                    || IS_CONST(*tok)
+                    || IS_LITERAL(*tok, "noerrno") || IS_LITERAL(*tok, "__noerrno__")) {
+                /* functions that don't touch errno */
+                ct->no_errno = 1;
+
+            } else if (IS_LITERAL(*tok, "queued") || IS_LITERAL(*tok, "__queued__")) {
+                /* callbacks that can be called from other threads */
+                ct->queued = QUEUED_RETURN;
+
+            } else if (IS_LITERAL(*tok, "queued_wait") || IS_LITERAL(*tok, "__queued_wait__")) {
+                ct->queued = QUEUED_WAIT;
             }
             /* ignore unknown tokens within parentheses */
         }
@@ -1570,7 +1602,12 @@ static struct ctype* parse_function(lua_State* L, struct parser* P, int ct_usr,
     struct token tok;
     int top = lua_gettop(L);
     struct ctype* ret;
+    /* attributes before the return type apply to the function */
+    unsigned no_errno = ct->no_errno;
+    unsigned queued = ct->queued;
 
+    ct->no_errno = 0;
+    ct->queued = 0;
     lua_newtable(L);
     ret = push_ctype(L, ct_usr, ct);
     lua_rawseti(L, -2, 0);
@@ -1581,6 +1618,8 @@ static struct ctype* parse_function(lua_State* L, struct parser* P, int ct_usr,
     ct->align_mask = min(FUNCTION_ALIGN_MASK, P->align_mask);
     ct->type = FUNCTION_TYPE;
     ct->is_defined = 1;
+    ct->no_errno = no_errno;
+    ct->queued = queued;
 
     if (name->type == TOK_NIL) {
         for (;;) {
@@ -1637,6 +1676,7 @@ static struct ctype* parse_argument2(lua_State* L, struct parser* P, int ct_usr,
     struct token tok;
     int top = lua_gettop(L);
     int ft_usr = 0;
+    struct ctype* ft = NULL;
 
     luaL_checkstack(L, 10, "function too complex");
     ct_usr = lua_absindex(L, ct_usr);
@@ -1665,7 +1705,19 @@ static struct ctype* parse_argument2(lua_State* L, struct parser* P, int ct_usr,
         } else if (parse_attribute(L, P, &tok, ct, asmname)) {
             /* parse attribute has filled out appropriate fields in type */
 
+            /* ct is now the return type, but no_errno and queued belong
+             * to the function e.g. int foo(int) __attribute__((pure)) */
+            if (ft && ct->no_errno) {
+                ct->no_errno = 0;
+                ft->no_errno = 1;
+            }
+            if (ft && ct->queued) {
+                ft->queued = ct->queued;
+                ct->queued = 0;
+            }
+
         } else if (tok.type == TOK_OPEN_PAREN) {
+            ft = ct;
             ct = parse_function(L, P, ct_usr, ct, name, asmname);
             ft_usr = lua_gettop(L);
 
@@ -2172,15 +2224,25 @@ static int parse_root(lua_State* L, struct parser* P)
 int ffi_cdef(lua_State* L)
 {
     struct parser P;
+    size_t sz;
 
     P.line = 1;
-    P.prev = P.next = luaL_checkstring(L, 1);
+    P.prev = P.next = luaL_checklstring(L, 1, &sz);
     P.align_mask = DEFAULT_ALIGN_MASK;
 
+    /* the cdef may change what type strings parse to */
+    clear_type_cache(L);
+
+    if (cdef_cache_begin(L, P.next, sz)) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
     if (parse_root(L, &P) == PRAGMA_POP) {
         luaL_error(L, "pragma pop without an associated push on line %d", P.line);
     }
 
+    cdef_cache_end(L);
     return 0;
 }
 
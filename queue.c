@@ -0,0 +1,361 @@
+/* vim: ts=4 sw=4 sts=4 et tw=78
+ * Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+ */
+#include "ffi.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* Queued callbacks are callbacks declared with __attribute__((queued)) or
+ * __attribute__((queued_wait)). When they are called from the thread that
+ * owns the lua_State they call the lua function directly as normal. Calls
+ * from any other thread copy their arguments into a slot in a ring and
+ * either return zero straight away (queued) or wait until the owning
+ * thread runs the lua function through ffi.poll() and then return its
+ * result (queued_wait).
+ *
+ * The ring is a bounded multi producer single consumer queue. Each slot has
+ * a sequence number which is the position it can next be claimed at.
+ * Producers claim a slot by moving head on with a compare and swap, fill in
+ * the arguments and then publish it by setting seq to pos+1. ffi.poll is the
+ * only consumer. After the call it hands the slot back by setting seq to
+ * pos+QUEUE_SIZE, or for queued_wait calls it sets done and the waiting
+ * producer hands the slot back once it has read the return value. When the
+ * ring is full producers yield until a slot is freed.
+ *
+ * Slots name the callback by an id rather than by its registry ref, as the
+ * ref can be reused as soon as the callback is freed. Ids aren't reused and
+ * freeing the callback removes its id from the queued table, so calls still
+ * in the ring are dropped by ffi.poll.
+ */
+
+#ifdef _WIN32
+typedef DWORD thread_id;
+#define current_thread() GetCurrentThreadId()
+#define same_thread(a, b) ((a) == (b))
+#define cas(p, o, n) (InterlockedCompareExchangePointer((PVOID volatile*) (p), (PVOID) (n), (PVOID) (o)) == (PVOID) (o))
+#define barrier() MemoryBarrier()
+#define yield() SwitchToThread()
+#else
+typedef pthread_t thread_id;
+#define current_thread() pthread_self()
+#define same_thread(a, b) pthread_equal(a, b)
+#define cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#define barrier() __sync_synchronize()
+#define yield() sched_yield()
+#endif
+
+struct call_queue {
+    volatile size_t head; /* next position to be claimed by a producer */
+    size_t tail; /* next position to be run by ffi.poll */
+    thread_id owner;
+    int last_id; /* id of the last queued callback compiled */
+    struct queued_call calls[QUEUE_SIZE];
+};
+
+/* queued_key[id] = upval table of the live queued callback with that id */
+static int queued_key;
+
+/* get_call_queue returns the queue of the lua_State, creating it with the
+ * current thread as the owner the first time a queued callback is
+ * compiled */
+struct call_queue* get_call_queue(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+    size_t i;
+
+    if (jit->queue == NULL) {
+        struct call_queue* q = (struct call_queue*) calloc(1, sizeof(struct call_queue));
+        if (q == NULL) {
+            luaL_error(L, "out of memory");
+        }
+
+        q->owner = current_thread();
+        for (i = 0; i < QUEUE_SIZE; i++) {
+            q->calls[i].seq = i;
+        }
+        jit->queue = q;
+
+        lua_newtable(L);
+        set_upval(L, &queued_key);
+    }
+
+    return jit->queue;
+}
+
+void free_call_queue(struct jit* jit)
+{
+    free(jit->queue);
+    jit->queue = NULL;
+}
+
+/* queue_reserve is called from queued callbacks. It returns NULL when called
+ * from the owning thread, otherwise it returns a slot for the arguments. */
+struct queued_call* queue_reserve(struct call_queue* q, int id, int wait)
+{
+    if (same_thread(q->owner, current_thread())) {
+        return NULL;
+    }
+
+    for (;;) {
+        size_t pos = q->head;
+        struct queued_call* c = &q->calls[pos % QUEUE_SIZE];
+        ptrdiff_t dif;
+
+        barrier();
+        dif = (ptrdiff_t) (c->seq - pos);
+
+        if (dif == 0) {
+            if (cas(&q->head, pos, pos + 1)) {
+                c->id = id;
+                c->wait = wait;
+                c->done = 0;
+                return c;
+            }
+        } else if (dif < 0) {
+            /* the ring is full */
+            yield();
+        }
+    }
+}
+
+/* add_queued_callback returns a new id for the queued callback with the
+ * upval table on the top of the stack */
+int add_queued_callback(lua_State* L)
+{
+    struct call_queue* q = get_call_queue(L);
+
+    if (q->last_id == INT_MAX) {
+        luaL_error(L, "too many queued callbacks");
+    }
+
+    q->last_id++;
+    lua_pushnumber(L, q->last_id);
+    lua_rawseti(L, -2, CALLBACK_QUEUED_USR_IDX);
+
+    push_upval(L, &queued_key);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, q->last_id);
+    lua_pop(L, 1);
+
+    return q->last_id;
+}
+
+/* cancel_queued_calls drops the calls that haven't been run yet to the
+ * callback with the upval table at idx, if it's queued */
+void cancel_queued_calls(lua_State* L, int idx)
+{
+    idx = lua_absindex(L, idx);
+    lua_rawgeti(L, idx, CALLBACK_QUEUED_USR_IDX);
+
+    if (!lua_isnil(L, -1)) {
+        push_upval(L, &queued_key);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, (int) lua_tointeger(L, -3));
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+}
+
+/* queue_commit publishes the slot filled in by the callback and sets ret to
+ * the value to return */
+void queue_commit(struct queued_call* c, union queued_value* ret)
+{
+    size_t pos = c->seq;
+    int wait = c->wait;
+
+    barrier();
+    c->seq = pos + 1;
+
+    memset(ret, 0, sizeof(*ret));
+
+    if (wait) {
+        while (!c->done) {
+            yield();
+        }
+        barrier();
+        *ret = c->ret;
+        c->done = 0;
+        barrier();
+        c->seq = pos + QUEUE_SIZE;
+    }
+}
+
+/* hands a slot run by ffi.poll back to the producers */
+static void finish_call(struct queued_call* c, size_t pos)
+{
+    barrier();
+    if (c->wait) {
+        c->done = 1;
+    } else {
+        c->seq = pos + QUEUE_SIZE;
+    }
+}
+
+static void push_queued_value(lua_State* L, int ct_idx, union queued_value* v)
+{
+    const struct ctype* mt = (const struct ctype*) lua_touserdata(L, ct_idx);
+
+    if (mt->pointers) {
+        lua_getuservalue(L, ct_idx);
+        *(void**) push_cdata(L, -1, mt) = v->p;
+        lua_remove(L, -2);
+        return;
+    }
+
+    switch (mt->type) {
+    case BOOL_TYPE:
+        lua_pushboolean(L, (uint8_t) v->u32);
+        break;
+    case INT8_TYPE:
+        lua_pushnumber(L, mt->is_unsigned ? (lua_Number) (uint8_t) v->u32 : (lua_Number) (int8_t) v->i32);
+        break;
+    case INT16_TYPE:
+        lua_pushnumber(L, mt->is_unsigned ? (lua_Number) (uint16_t) v->u32 : (lua_Number) (int16_t) v->i32);
+        break;
+    case ENUM_TYPE:
+    case INT32_TYPE:
+        lua_pushnumber(L, mt->is_unsigned ? (lua_Number) v->u32 : (lua_Number) v->i32);
+        break;
+    case INT64_TYPE:
+        *(int64_t*) push_cdata(L, 0, mt) = v->i64;
+        break;
+    case INTPTR_TYPE:
+        *(void**) push_cdata(L, 0, mt) = v->p;
+        break;
+    case FLOAT_TYPE:
+    case DOUBLE_TYPE:
+        lua_pushnumber(L, v->d);
+        break;
+    default:
+        luaL_error(L, "NYI: queued callback arg type");
+    }
+}
+
+static void check_queued_value(lua_State* L, int idx, int ct_idx, union queued_value* v)
+{
+    const struct ctype* mt = (const struct ctype*) lua_touserdata(L, ct_idx);
+
+    idx = lua_absindex(L, idx);
+    lua_getuservalue(L, ct_idx);
+
+    if (mt->pointers) {
+        v->p = check_typed_pointer(L, idx, lua_gettop(L), mt);
+        return;
+    }
+
+    switch (mt->type) {
+    case ENUM_TYPE:
+        v->i32 = check_enum(L, idx, lua_gettop(L), mt);
+        break;
+    case BOOL_TYPE:
+    case INT8_TYPE:
+    case INT16_TYPE:
+    case INT32_TYPE:
+        if (mt->is_unsigned) {
+            v->u32 = check_uint32(L, idx);
+        } else {
+            v->i32 = check_int32(L, idx);
+        }
+        break;
+    case INT64_TYPE:
+        if (mt->is_unsigned) {
+            v->u64 = check_uint64(L, idx);
+        } else {
+            v->i64 = check_int64(L, idx);
+        }
+        break;
+    case INTPTR_TYPE:
+        v->p = (void*) check_uintptr(L, idx);
+        break;
+    case FLOAT_TYPE:
+    case DOUBLE_TYPE:
+        v->d = check_double(L, idx);
+        break;
+    default:
+        luaL_error(L, "NYI: queued callback return type");
+    }
+}
+
+/* runs the queued call given as a light userdata in a protected call so
+ * that the slot is always handed back */
+static int run_queued_call(lua_State* L)
+{
+    struct queued_call* c = (struct queued_call*) lua_touserdata(L, 1);
+    const struct ctype* rt;
+    int i, nargs, usr;
+
+    push_upval(L, &queued_key);
+    lua_rawgeti(L, -1, c->id);
+    lua_remove(L, -2);
+    if (lua_isnil(L, -1)) {
+        /* the callback has been freed */
+        return 0;
+    }
+
+    lua_rawgeti(L, -1, CALLBACK_TYPE_USR_IDX);
+    usr = lua_gettop(L);
+    nargs = (int) lua_rawlen(L, usr);
+
+    lua_rawgeti(L, usr - 1, CALLBACK_FUNC_USR_IDX);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, (int) lua_tointeger(L, -1));
+    lua_remove(L, -2);
+
+    for (i = 1; i <= nargs; i++) {
+        lua_rawgeti(L, usr, i);
+        push_queued_value(L, -1, &c->args[i-1]);
+        lua_remove(L, -2);
+    }
+
+    lua_rawgeti(L, usr, 0);
+    rt = (const struct ctype*) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (!c->wait || (!rt->pointers && rt->type == VOID_TYPE)) {
+        lua_call(L, nargs, 0);
+    } else {
+        lua_call(L, nargs, 1);
+        lua_rawgeti(L, usr, 0);
+        check_queued_value(L, -2, -1, &c->ret);
+    }
+
+    return 0;
+}
+
+/* ffi.poll([max]) runs up to max (default all) queued calls from other
+ * threads and returns the number run */
+int ffi_poll(lua_State* L)
+{
+    struct call_queue* q = get_jit(L)->queue;
+    int max = lua_isnoneornil(L, 1) ? -1 : (int) luaL_checknumber(L, 1);
+    int num = 0;
+
+    while (q && num != max) {
+        size_t pos = q->tail;
+        struct queued_call* c = &q->calls[pos % QUEUE_SIZE];
+
+        if (c->seq != pos + 1) {
+            break;
+        }
+
+        barrier();
+        memset(&c->ret, 0, sizeof(c->ret));
+        q->tail++;
+        num++;
+
+        lua_pushcfunction(L, &run_queued_call);
+        lua_pushlightuserdata(L, c);
+        if (lua_pcall(L, 1, 0, 0)) {
+            finish_call(c, pos);
+            return lua_error(L);
+        }
+
+        finish_call(c, pos);
+    }
+
+    lua_pushnumber(L, num);
+    return 1;
+}
@@ -0,0 +1,147 @@
+/* vim: ts=4 sw=4 sts=4 et tw=78
+ * Copyright (c) 2011 James R. McKaskill. See license in ffi.h
+ */
+#include "ffi.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#if defined ARCH_X86 || defined ARCH_X64
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define read_tsc() __rdtsc()
+#else
+/* only the x86 code counts calls, elsewhere the clock just has to tick */
+#define read_tsc() ((uint64_t) (get_time() * 1e9))
+#endif
+
+/* While ffi.stats is on, the code compiled for calls and callbacks counts
+ * each call and times it with rdtsc, for calls around the C function and for
+ * callbacks around the lua function. The counters are struct call_stats
+ * userdatas in the stats table keyed by the name of the function, or for
+ * callbacks and calls through function pointers by their type, so bindings
+ * with the same name share them. Code compiled while ffi.stats is off is
+ * unchanged so costs nothing, which also means functions already looked up
+ * in a library aren't counted. Variadic functions are never counted.
+ */
+
+static int stats_key;
+
+/* seconds from an arbitrary start */
+double get_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void push_stats_table(lua_State* L)
+{
+    push_upval(L, &stats_key);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        set_upval(L, &stats_key);
+    }
+}
+
+/* push_call_stats pushes the stats userdata for the function name, or for
+ * the type ct if name is NULL */
+struct call_stats* push_call_stats(lua_State* L, int ct_usr, const struct ctype* ct, const char* name, int callback)
+{
+    ct_usr = lua_absindex(L, ct_usr);
+    push_stats_table(L);
+
+    if (name) {
+        lua_pushstring(L, name);
+    } else {
+        lua_pushstring(L, callback ? "callback " : "");
+        push_type_name(L, ct_usr, ct);
+        lua_concat(L, 2);
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        memset(lua_newuserdata(L, sizeof(struct call_stats)), 0, sizeof(struct call_stats));
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -5);
+    }
+
+    /* stats tbl, name, stats */
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return (struct call_stats*) lua_touserdata(L, -1);
+}
+
+/* ffi.stats([on]) turns counting of the calls and callbacks compiled from
+ * then on, on or off. It returns a table of name -> {calls = number, time =
+ * total seconds, max = seconds} for all of the counted functions. */
+int ffi_stats(lua_State* L)
+{
+    struct jit* jit = get_jit(L);
+    double tick = 0;
+
+    if (!lua_isnoneornil(L, 1)) {
+        jit->stats = lua_toboolean(L, 1);
+
+        if (jit->stats && !jit->stats_tsc) {
+            jit->stats_time = get_time();
+            jit->stats_tsc = read_tsc();
+        }
+    }
+
+    lua_settop(L, 0);
+    lua_newtable(L);
+
+    if (jit->stats_tsc) {
+        /* the tsc rate is measured over the time since stats were first
+         * turned on, which gets more accurate the longer they run */
+        double secs = get_time() - jit->stats_time;
+        uint64_t ticks = read_tsc() - jit->stats_tsc;
+
+        if (ticks) {
+            tick = secs / (double) ticks;
+        }
+    }
+
+    push_stats_table(L);
+    lua_pushnil(L);
+
+    while (lua_next(L, 2)) {
+        struct call_stats* s = (struct call_stats*) lua_touserdata(L, -1);
+
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, (lua_Number) s->calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, (lua_Number) s->ticks * tick);
+        lua_setfield(L, -2, "time");
+        lua_pushnumber(L, (lua_Number) s->max * tick);
+        lua_setfield(L, -2, "max");
+
+        /* result[name] = entry */
+        lua_pushvalue(L, -3);
+        lua_insert(L, -2);
+        lua_rawset(L, 1);
+        lua_pop(L, 1);
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
@@ -7,11 +7,13 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <errno.h>
+#include <pthread.h>
 #endif
 
 #if __STDC_VERSION__+0 >= 199901L
@@ -72,6 +74,10 @@ EXPORT int test_pow(int v);
 int test_pow(int v)
 { return v * v; }
 
+EXPORT int count_varargs(int n, ...);
+int count_varargs(int n, ...)
+{ return n; }
+
 #define ADD(TYPE, NAME) \
     EXPORT TYPE NAME(TYPE a, TYPE b); \
     TYPE NAME(TYPE a, TYPE b) { return a + b; }
@@ -675,3 +681,144 @@ EXPORT int va_list_size, va_list_align;
 int va_list_size = sizeof(va_list);
 int va_list_align = alignof(va_list);
 
+struct vec2 { float x, y; };
+struct vec3 { double x, y, z; };
+struct mixed { int32_t a; double b; };
+struct rgb { uint8_t r, g, b; };
+struct i64pair { int64_t a, b; };
+union intfloat { int32_t i; float f; };
+
+EXPORT struct vec2 add_vec2(struct vec2 a, struct vec2 b);
+EXPORT void add_vec2_ptr(struct vec2* r, const struct vec2* a, const struct vec2* b);
+EXPORT struct vec3 scale_vec3(struct vec3 v, double s);
+EXPORT struct mixed make_mixed(int32_t a, double b);
+EXPORT double sum_mixed(struct mixed a, struct mixed b, struct mixed c, struct mixed d, struct mixed e, struct mixed f, struct mixed g);
+EXPORT struct rgb invert_rgb(struct rgb c);
+EXPORT struct i64pair swap_i64pair(struct i64pair p);
+EXPORT union intfloat negate_intfloat(union intfloat u);
+
+EXPORT struct vec2 call_vec2(struct vec2 (*f)(struct vec2, struct vec2), struct vec2 a, struct vec2 b);
+EXPORT struct vec3 call_vec3(struct vec3 (*f)(struct vec3, double), struct vec3 v, double s);
+EXPORT double call_mixed(double (*f)(struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed));
+EXPORT struct rgb call_rgb(struct rgb (*f)(struct rgb), struct rgb c);
+
+struct vec2 add_vec2(struct vec2 a, struct vec2 b) {
+    struct vec2 r = {a.x + b.x, a.y + b.y};
+    return r;
+}
+
+void add_vec2_ptr(struct vec2* r, const struct vec2* a, const struct vec2* b) {
+    *r = add_vec2(*a, *b);
+}
+
+struct vec3 scale_vec3(struct vec3 v, double s) {
+    struct vec3 r = {v.x * s, v.y * s, v.z * s};
+    return r;
+}
+
+struct mixed make_mixed(int32_t a, double b) {
+    struct mixed r = {a, b};
+    return r;
+}
+
+double sum_mixed(struct mixed a, struct mixed b, struct mixed c, struct mixed d, struct mixed e, struct mixed f, struct mixed g) {
+    return a.a + a.b + b.a + b.b + c.a + c.b + d.a + d.b + e.a + e.b + f.a + f.b + g.a + g.b;
+}
+
+struct rgb invert_rgb(struct rgb c) {
+    struct rgb r = {255 - c.r, 255 - c.g, 255 - c.b};
+    return r;
+}
+
+struct i64pair swap_i64pair(struct i64pair p) {
+    struct i64pair r = {p.b, p.a};
+    return r;
+}
+
+union intfloat negate_intfloat(union intfloat u) {
+    u.f = -u.f;
+    return u;
+}
+
+struct vec2 call_vec2(struct vec2 (*f)(struct vec2, struct vec2), struct vec2 a, struct vec2 b) {
+    return f(a, b);
+}
+
+struct vec3 call_vec3(struct vec3 (*f)(struct vec3, double), struct vec3 v, double s) {
+    return f(v, s);
+}
+
+double call_mixed(double (*f)(struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed)) {
+    return f(make_mixed(1, 0.5), make_mixed(2, 0.5), make_mixed(3, 0.5), make_mixed(4, 0.5), make_mixed(5, 0.5), make_mixed(6, 0.5), make_mixed(7, 0.5));
+}
+
+struct rgb call_rgb(struct rgb (*f)(struct rgb), struct rgb c) {
+    return f(c);
+}
+
+/* runs f(a, b) on a new thread to test queued callbacks */
+struct thread_call {
+    double (*f)(int32_t, double);
+    int32_t a;
+    double b;
+    double ret;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+EXPORT struct thread_call* start_thread_call(double (*f)(int32_t, double), int32_t a, double b);
+EXPORT double join_thread_call(struct thread_call* t);
+
+#ifdef _WIN32
+static DWORD WINAPI run_thread_call(LPVOID p) {
+    struct thread_call* t = (struct thread_call*) p;
+    t->ret = t->f(t->a, t->b);
+    return 0;
+}
+#else
+static void* run_thread_call(void* p) {
+    struct thread_call* t = (struct thread_call*) p;
+    t->ret = t->f(t->a, t->b);
+    return NULL;
+}
+#endif
+
+struct thread_call* start_thread_call(double (*f)(int32_t, double), int32_t a, double b) {
+    struct thread_call* t = (struct thread_call*) malloc(sizeof(struct thread_call));
+    t->f = f;
+    t->a = a;
+    t->b = b;
+#ifdef _WIN32
+    t->thread = CreateThread(NULL, 0, &run_thread_call, t, 0, NULL);
+#else
+    pthread_create(&t->thread, NULL, &run_thread_call, t);
+#endif
+    return t;
+}
+
+double join_thread_call(struct thread_call* t) {
+    double ret;
+#ifdef _WIN32
+    WaitForSingleObject(t->thread, INFINITE);
+    CloseHandle(t->thread);
+#else
+    pthread_join(t->thread, NULL);
+#endif
+    ret = t->ret;
+    free(t);
+    return ret;
+}
+
+/* burns cpu for the async tests and benchmark */
+EXPORT uint64_t spin(uint32_t n);
+
+uint64_t spin(uint32_t n) {
+    uint64_t x = n;
+    while (n--) {
+        x = x * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+    }
+    return x;
+}
@@ -332,6 +332,24 @@ for convention,c in pairs(dlls) do
     check(c.add_i16(2000,4000), 6000)
     check(c.add_d(20, 12), 32)
     check(c.add_f(40, 32), 72)
+    do
+        local t = ffi.bind(c, {'add_u8', 'add_i16', 'add_u32', 'g_i32'})
+        check(t.add_u8(250, 10), 4)
+        check(t.add_u32(1, 2), 3)
+        check(t.add_u8, c.add_u8)
+        check(t.g_i32, c.g_i32)
+        assert(not pcall(ffi.bind, c, {'add_d', 'does_not_exist'}))
+        check(c.add_d(1, 2), 3)
+    end
+    check(c.add_i32(3e9, 0), -1294967296)
+    check(c.add_i32(true, 2), 3)
+    check(c.add_i32(ffi.new('int32_t', 3), 4), 7)
+    check(c.add_u32(-1, 2), 1)
+    check(c.add_i64(2.5, -1.5), i64(1))
+    check(c.add_d(ffi.new('double', 0.5), 0.25), 0.75)
+    check(c.add_f(true, 1), 2)
+    assert(not pcall(c.add_i32, '1', 2))
+    check(c.add_d(nil, 2), 2)
     check(c.not_b(true), false)
     check(c.not_b2(false), true)
     check(c.inc_e8(c.FOO8), c.BAR8)
@@ -558,6 +576,18 @@ for convention,c in pairs(dlls) do
     check(ffi.string(c.call_s(cb, 'foobar')), 'bar')
     cb:set(function(s) return s + u2 end)
     check(ffi.string(c.call_s(cb, 'foobar')), 'obar')
+    cb:free()
+
+    -- callbacks created without a function can be set later
+    local cb = ffi.new('int (*)(int)', nil)
+    assert(not pcall(c.call_i, cb, 1))
+    cb:set(function(v) return v + 2 end)
+    check(c.call_i(cb, 1), 3)
+    cb:free()
+
+    -- freeing again does nothing
+    cb:free()
+    assert(not pcall(cb.set, cb, function() end))
 
     local fp = ffi.new('struct fptr')
     assert(fp.p == ffi.C.NULL)
@@ -602,6 +632,20 @@ for convention,c in pairs(dlls) do
     check(ffi.sizeof('va_list'), c.va_list_size)
     check(ffi.alignof('va_list'), c.va_list_align)
 
+    -- functions with the same prototype share the same thunk
+    do
+        local function nthunks()
+            local n = 0
+            for _ in pairs(ffi.debug().thunks) do n = n + 1 end
+            return n
+        end
+        local buf = ffi.new('char[256]')
+        check(c.print_s(buf, 'foo'), 3)
+        local n = nthunks()
+        check(c.print_p(buf, nil) > 0, true)
+        check(nthunks(), n)
+    end
+
     first = false
 end
 
@@ -611,6 +655,387 @@ assert(c.sprintf(buf, "%g", 5.3) == 3 and ffi.string(buf) == '5.3')
 assert(c.sprintf(buf, "%d", false) == 1 and ffi.string(buf) == '0')
 assert(c.sprintf(buf, "%d%g", false, 6.7) == 4 and ffi.string(buf) == '06.7')
 
+-- variadic calls switch to specialized thunks after being called enough
+-- times with the same argument types
+local buf2 = ffi.new('char[256]')
+for i = 1, 200 do
+    check(c.sprintf(buf, "%g %s %d %s", i + 0.5, "x", true, nil), #ffi.string(buf))
+    check(ffi.string(buf), (i + 0.5) .. ' x 1 (null)')
+    check(c.sprintf(buf2, "%s%s", buf, ffi.cast('const char*', 'y')), #ffi.string(buf2))
+    check(ffi.string(buf2), (i + 0.5) .. ' x 1 (null)y')
+    check(c.sprintf(buf, "%d", i % 2 == 0), 1)
+    check(ffi.string(buf), i % 2 == 0 and '1' or '0')
+end
+check(c.sprintf(buf, "%g %s", 1.5, "z"), 5)
+check(ffi.string(buf), '1.5 z')
+check(c.sprintf(buf, "%d", ffi.new('int32_t', 7)), 1)
+check(ffi.string(buf), '7')
+assert(not pcall(c.sprintf, buf))
+-- userdata that aren't cdata always take the generic path
+local stdout_len = c.sprintf(buf, "%p", io.stdout)
+for i = 1, 200 do
+    check(c.sprintf(buf, "%p", io.stdout), stdout_len)
+end
+
+-- functions declared pure, const or noerrno don't save or restore errno
+ffi.cdef [[
+void set_errno_noerrno(int val) __asm__("set_errno") __attribute__((noerrno));
+int get_errno_noerrno(void) __asm__("get_errno") __attribute__((noerrno));
+__attribute__((pure)) int32_t add_i32_pure(int32_t a, int32_t b) __asm__("add_i32");
+uint32_t add_u32_const(uint32_t a, uint32_t b) __attribute__((const)) __asm__("add_u32");
+double add_d_pure(double a, double b) __asm__("add_d") __attribute__((__pure__));
+bool have_complex_pure() __asm__("have_complex") __attribute__((pure));
+]]
+local t = dlls.__cdecl
+ffi.errno(5)
+t.set_errno_noerrno(9)
+check(ffi.errno(), 5)
+check(t.get_errno_noerrno(), 9)
+check(ffi.errno(), 5)
+check(t.get_errno(), 5)
+check(t.add_i32_pure(-3, 5), 2)
+check(t.add_u32_const(0xFFFFFFFF, 2), 1)
+check(t.add_d_pure(1.5, 2), 3.5)
+check(t.have_complex_pure(), t.have_complex())
+
+-- structs and unions by value
+if ffi.arch == 'x64' then
+    ffi.cdef [[
+    struct vec2 { float x, y; };
+    struct vec3 { double x, y, z; };
+    struct mixed { int32_t a; double b; };
+    struct rgb { uint8_t r, g, b; };
+    struct i64pair { int64_t a, b; };
+    union intfloat { int32_t i; float f; };
+    struct vec2 add_vec2(struct vec2 a, struct vec2 b);
+    struct vec3 scale_vec3(struct vec3 v, double s);
+    struct mixed make_mixed(int32_t a, double b);
+    double sum_mixed(struct mixed a, struct mixed b, struct mixed c, struct mixed d, struct mixed e, struct mixed f, struct mixed g);
+    struct rgb invert_rgb(struct rgb c);
+    struct i64pair swap_i64pair(struct i64pair p);
+    union intfloat negate_intfloat(union intfloat u);
+    struct vec2 call_vec2(struct vec2 (*f)(struct vec2, struct vec2), struct vec2 a, struct vec2 b);
+    struct vec3 call_vec3(struct vec3 (*f)(struct vec3, double), struct vec3 v, double s);
+    double call_mixed(double (*f)(struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed, struct mixed));
+    struct rgb call_rgb(struct rgb (*f)(struct rgb), struct rgb c);
+    ]]
+
+    local v = t.add_vec2(ffi.new('struct vec2', 1, 2), {x = 0.5, y = 4})
+    check(v.x, 1.5)
+    check(v.y, 6)
+    v = t.scale_vec3({1, 2, 3}, 2)
+    check(v.x + v.y * 10 + v.z * 100, 2 + 40 + 600)
+    v = t.make_mixed(-3, 2.5)
+    check(v.a, -3)
+    check(v.b, 2.5)
+    check(t.sum_mixed(v, v, v, v, v, v, {4, 0.25}), 6 * -0.5 + 4.25)
+    v = t.invert_rgb({1, 2, 3})
+    check(v.r * 0x10000 + v.g * 0x100 + v.b, 0xFEFDFC)
+    v = t.swap_i64pair({1, -2})
+    check(tonumber(v.a), -2)
+    check(tonumber(v.b), 1)
+    check(t.negate_intfloat(ffi.new('union intfloat', {f = 1.5})).f, -1.5)
+
+    v = t.call_vec2(function(a, b) return {a.x * b.x, a.y * b.y} end, {2, 3}, {4, 5})
+    check(v.x, 8)
+    check(v.y, 15)
+    v = t.call_vec3(function(v, s) return ffi.new('struct vec3', v.z * s, v.y * s, v.x * s) end, {1, 2, 3}, 0.5)
+    check(v.x + v.y * 10 + v.z * 100, 1.5 + 10 + 50)
+    check(t.call_mixed(function(a, b, c, d, e, f, g)
+        return a.a + b.a + c.a + d.a + e.a + f.a + g.a * 10 + a.b + g.b
+    end), 1 + 2 + 3 + 4 + 5 + 6 + 70 + 1)
+    v = t.call_rgb(function(c) return {c.b, c.g, c.r} end, {1, 2, 3})
+    check(v.r * 0x10000 + v.g * 0x100 + v.b, 0x030201)
+end
+
+-- ffi.map calls a function over arrays
+do
+    local n = 100
+    local ia, ib, io = ffi.new('int32_t[?]', n), ffi.new('int32_t[?]', n), ffi.new('int32_t[?]', n)
+    local fa, fo = ffi.new('float[?]', n), ffi.new('float[?]', n)
+    local la, lo = ffi.new('int64_t[?]', n), ffi.new('int64_t[?]', n)
+    local ca, co = ffi.new('int8_t[?]', n), ffi.new('int8_t[?]', n)
+    local ba, bo = ffi.new('bool[?]', n), ffi.new('bool[?]', n)
+    for i = 0, n - 1 do
+        ia[i], ib[i] = i, -2 * i
+        fa[i] = i * 0.25
+        la[i] = i * 0x10000000
+        ca[i] = i
+        ba[i] = i % 3 == 0
+    end
+    check(ffi.map(t.add_i32, n, io, ia, ib), io)
+    check(ffi.map(t.add_f, n, fo, fa, fa), fo)
+    ffi.map(t.add_i64, n, lo, la, la)
+    ffi.map(t.add_i8, n, co, ca, ca)
+    ffi.map(t.not_b, n, bo, ba)
+    for i = 0, n - 1 do
+        check(io[i], -i)
+        check(fo[i], i * 0.5)
+        check(lo[i], ffi.new('int64_t', 2 * i * 0x10000000))
+        check(co[i], (2 * i + 128) % 256 - 128)
+        check(bo[i], i % 3 ~= 0)
+    end
+
+    local add = ffi.cast('int32_t (*)(int32_t, int32_t)', function(a, b) return a * b end)
+    ffi.map(add, n, io, ia, ia)
+    check(io[n - 1], (n - 1) * (n - 1))
+    add:free()
+
+    io[0] = 7
+    ffi.map(t.add_i32, 0, io, ia, ib)
+    check(io[0], 7)
+    assert(not pcall(ffi.map, t.add_i32, n, io, ia))
+    assert(not pcall(ffi.map, t.add_i32, n, io, ia, ffi.new('double[?]', n)))
+    assert(not pcall(ffi.map, t.add_i32, n, io, ia, nil))
+    assert(not pcall(ffi.map, print, n, io, ia, ib))
+    assert(not pcall(ffi.map, t.add_i32, -1, io, ia, ib))
+    assert(not pcall(ffi.map, t.add_i32, 1.5, io, ia, ib))
+    assert(not pcall(ffi.map, t.add_i32, ffi.new('int64_t', -1), io, ia, ib))
+    assert(not pcall(ffi.map, t.add_i32, n + 1, io, ia, ib))
+    assert(not pcall(ffi.map, t.add_i32, n, io, ia, ffi.new('int32_t[?]', n - 1)))
+    ffi.map(t.add_i32, ffi.new('uint8_t', 3), io, ia, ib)
+    check(io[2], -2)
+end
+
+-- queued callbacks called from other threads run in ffi.poll
+ffi.cdef [[
+struct thread_call;
+struct thread_call* start_thread_call(double (*f)(int32_t, double), int32_t a, double b);
+double join_thread_call(struct thread_call* t);
+]]
+
+do
+    local got
+    local qr = ffi.cast('__attribute__((queued)) double (*)(int32_t, double)', function(a, b)
+        got = a + b
+        return a * b
+    end)
+
+    -- the owning thread calls the function directly
+    check(qr(2, 3.5), 7)
+    check(got, 5.5)
+    check(ffi.poll(), 0)
+
+    got = nil
+    local th = t.start_thread_call(qr, 3, 0.5)
+    check(t.join_thread_call(th), 0)
+    check(got, nil)
+    check(ffi.poll(), 1)
+    check(got, 3.5)
+
+    local qw = ffi.cast('double (*)(int32_t, double) __attribute__((queued_wait))', function(a, b) return a * b end)
+    th = t.start_thread_call(qw, 3, 0.5)
+    while ffi.poll() == 0 do end
+    check(t.join_thread_call(th), 1.5)
+
+    -- other threads can run queued callbacks while code is compiled and freed
+    th = t.start_thread_call(qw, 2, 2)
+    repeat
+        ffi.cast('int (*)(int)', function(a) return a end):free()
+    until ffi.poll() > 0
+    check(t.join_thread_call(th), 4)
+
+    -- errors are raised from ffi.poll and the thread gets zero
+    local qe = ffi.cast('double (__attribute__((queued_wait)) *)(int32_t, double)', function() error('queued error', 0) end)
+    th = t.start_thread_call(qe, 1, 1)
+    local ok, err
+    repeat
+        ok, err = pcall(ffi.poll)
+    until not ok
+    check(err, 'queued error')
+    check(t.join_thread_call(th), 0)
+
+    -- calls still queued when the callback is freed are dropped, even if a
+    -- new callback reuses its registry slot
+    got = nil
+    th = t.start_thread_call(qr, 4, 1)
+    t.join_thread_call(th)
+    qr:free()
+    local reused = ffi.cast('__attribute__((queued)) double (*)(int32_t, double)', function(a, b)
+        got = 'wrong function'
+        return 0
+    end)
+    check(ffi.poll(), 1)
+    check(got, nil)
+
+    reused:free()
+    qw:free()
+    qe:free()
+    assert(not pcall(ffi.cast, '__attribute__((queued)) void (*)(struct vec2)', function() end))
+end
+
+-- ffi.async runs calls on the worker threads
+ffi.cdef [[
+uint64_t spin(uint32_t n);
+]]
+
+do
+    local h = ffi.async(t.add_i32, 3, 4)
+    check(h:wait(), 7)
+    check(h:ready(), true)
+    check(h:wait(), 7)
+    check(ffi.async(t.add_d, 1.5, 2):wait(), 3.5)
+    check(ffi.async(t.add_f, 1.5, 2):wait(), 3.5)
+    check(ffi.async(t.add_i64, 1, 2):wait(), ffi.new('int64_t', 3))
+    check(ffi.async(t.add_i8, 100, 100):wait(), -56)
+    check(ffi.async(t.not_b, true):wait(), false)
+
+    local buf = ffi.new('char[256]')
+    check(ffi.async(t.print_s, buf, 'foo'):wait(), 3)
+    check(ffi.string(buf), 'foo')
+
+    local hs = {}
+    for i = 1, 64 do
+        hs[i] = ffi.async(t.spin, i * 1000)
+    end
+    for i = 1, 64 do
+        check(hs[i]:wait(), t.spin(i * 1000))
+    end
+
+    -- a coroutine can yield until the call is done
+    local co = coroutine.wrap(function()
+        local h = ffi.async(t.spin, 100000)
+        while not h:ready() do
+            coroutine.yield()
+        end
+        return h:wait()
+    end)
+    local r
+    repeat
+        r = co()
+    until r
+    check(r, t.spin(100000))
+
+    -- function pointers have an async method, lua callbacks have to be queued
+    local got
+    local qr = ffi.cast('__attribute__((queued)) double (*)(int32_t, double)', function(a, b) got = a + b end)
+    check(qr:async(1, 2):wait(), 0)
+    check(ffi.poll(), 1)
+    check(got, 3)
+    qr:free()
+
+    -- the workers can run calls while code is compiled and freed
+    h = ffi.async(t.spin, 1000000)
+    for i = 1, 200 do
+        ffi.cast('int (*)(int)', function(a) return a end):free()
+    end
+    check(h:wait(), t.spin(1000000))
+
+    -- handles that are never waited on are collected
+    for i = 1, 16 do
+        ffi.async(t.spin, 10000)
+    end
+    collectgarbage()
+
+    local cb = ffi.cast('int32_t (*)(int32_t, int32_t)', function(a, b) return a + b end)
+    assert(not pcall(ffi.async, cb, 1, 2))
+    cb:free()
+    assert(not pcall(ffi.async, t.add_i32, 1))
+    assert(not pcall(ffi.async, t.add_dc, 1, 2))
+    assert(not pcall(ffi.async, print, 1, 2))
+    assert(not pcall(ffi.async, t.ret_fp, t.not_b))
+end
+
+-- ffi.stats counts the calls and callbacks compiled while it's on
+ffi.cdef [[
+int32_t stats_add_i32(int32_t a, int32_t b) __asm__("add_i32");
+double stats_add_d(double a, double b) __asm__("add_d");
+]]
+
+do
+    local add0 = t.add_i32
+    ffi.stats(true)
+    local add, addd = t.stats_add_i32, t.stats_add_d
+    local cb = ffi.cast('int32_t (*)(int32_t, int32_t)', function(a, b) return a - b end)
+    ffi.stats(false)
+
+    for i = 1, 10 do
+        check(add(i, 1), i + 1)
+        check(add0(i, 1), i + 1)
+    end
+    check(addd(1.5, 2), 3.5)
+    check(cb(5, 3), 2)
+    assert(not pcall(add, 'a', 1))
+
+    local s = ffi.stats()
+    check(s.stats_add_i32.calls, 10)
+    assert(s.stats_add_i32.max > 0 and s.stats_add_i32.max <= s.stats_add_i32.time)
+    check(s.stats_add_d.calls, 1)
+    check(s['callback int (*)(int, int)'].calls, 1)
+    check(s.add_i32, nil)
+    cb:free()
+end
+
+-- ffi.perfmap names the code compiled while it's on for perf
+if ffi.os ~= 'Windows' then
+    -- calls with the same type share code so use a new one
+    ffi.cdef [[
+    uint16_t perf_add_u16(uint16_t a, uint16_t b, int8_t c) __asm__("add_u16");
+    ]]
+
+    local path = ffi.perfmap(true)
+    local f = t.perf_add_u16
+    local cb = ffi.cast('int32_t (*)(int32_t, int32_t)', function(a, b) return a - b end)
+    cb:free()
+    check(ffi.perfmap(false), nil)
+
+    local file = io.open(path)
+    local map = file:read('*a')
+    file:close()
+    os.remove(path)
+    assert(map:find('%x+ %x+ ffi call unsigned short %(%*%)%(unsigned short, unsigned short, char%)\n'))
+    local addr = map:match('(%x+) %x+ ffi callback int %(%*%)%(int, int%)\n')
+    assert(addr and map:find(addr .. ' %x+ ffi freed\n'))
+end
+
+-- ffi.gdbjit registers the code compiled while it's on with gdb
+if ffi.os == 'Linux' and (ffi.arch == 'x86' or ffi.arch == 'x64') then
+    ffi.cdef [[
+    struct jit_code_entry {
+        struct jit_code_entry* next_entry;
+        struct jit_code_entry* prev_entry;
+        const char* symfile_addr;
+        uint64_t symfile_size;
+    };
+    struct jit_descriptor {
+        uint32_t version;
+        uint32_t action_flag;
+        struct jit_code_entry* relevant_entry;
+        struct jit_code_entry* first_entry;
+    };
+    extern struct jit_descriptor __jit_debug_descriptor;
+    int8_t gdb_add_i8(int8_t a, int8_t b, int8_t c) __asm__("add_i8");
+    uint8_t gdb_add_u8(uint8_t a, uint8_t b, uint8_t c) __asm__("add_u8");
+    ]]
+
+    local desc = ffi.load('./ffi.so').__jit_debug_descriptor
+    local function registered(name)
+        local e = desc.first_entry
+        while e ~= ffi.C.NULL do
+            local elf = ffi.string(e.symfile_addr, tonumber(e.symfile_size))
+            if elf:sub(1, 4) == '\127ELF' and elf:find(name, 1, true) then
+                return e
+            end
+            e = e.next_entry
+        end
+    end
+
+    ffi.gdbjit(true)
+    -- functions compiled by ffi.bind are registered as one object
+    local fns = ffi.bind(dlls.__cdecl, {'gdb_add_i8', 'gdb_add_u8'})
+    check(fns.gdb_add_i8(1, 2, 0), 3)
+    local e = registered('ffi call char (*)(char, char, char)')
+    assert(e and e == registered('ffi call unsigned char (*)(unsigned char, unsigned char, unsigned char)'))
+    assert(ffi.string(e.symfile_addr, tonumber(e.symfile_size)):find('.eh_frame', 1, true))
+
+    local cb = ffi.cast('int16_t (*)(int16_t)', function(a) return a end)
+    assert(registered('ffi callback short (*)(short)'))
+    ffi.gdbjit(false)
+    cb:free()
+    assert(not registered('ffi callback short (*)(short)'))
+    check(desc.action_flag, 2)
+end
+
 assert(ffi.sizeof('uint32_t[?]', 32) == 32 * 4)
 assert(ffi.sizeof(ffi.new('uint32_t[?]', 32)) == 32 * 4)
 
@@ -866,6 +1291,338 @@ local c = ffi.cast("struct ptest *", b)
 assert(c.banana == "banana") -- should have same methods
 assert(#c == 3)
 
+-- freed jit code is reused
+local function churn(n)
+    local cbs = {}
+    for j = 1, n do
+        cbs[j] = ffi.cast('int (*)(int)', function(x) return x + j end)
+    end
+    for j = 1, n, 2 do
+        cbs[j]:free()
+    end
+    for j = 1, n, 2 do
+        cbs[j] = ffi.cast('int (*)(int)', function(x) return x - j end)
+    end
+    for j = 1, n do
+        check(cbs[j](100), j % 2 == 1 and 100 - j or 100 + j)
+        cbs[j]:free()
+    end
+end
+churn(200)
+local code = ffi.debug().code
+churn(200)
+check(ffi.debug().code.pages, code.pages)
+check(ffi.debug().code.used, code.used)
+
+-- ffi.jitstats counts compiles and the live and freed code
+local stats = ffi.jitstats()
+churn(10)
+local stats2 = ffi.jitstats()
+check(stats2.pages, stats.pages)
+check(stats2.live, stats.live)
+check(stats2.compiles.callback, stats.compiles.callback + 15)
+check(stats2.compiles.call, stats.compiles.call)
+assert(stats2.freed > stats.freed)
+assert(stats2.link_time >= stats.link_time and stats2.encode_time > 0)
+
+-- freed chunks merge with free chunks on both sides
+do
+    local cbs, order = {}, {}
+    local function addr(j) return tonumber(ffi.cast('intptr_t', cbs[j])) end
+    for j = 1, 40 do
+        cbs[j] = ffi.cast('int (*)(int)', function(x) return x + j end)
+        order[j] = j
+    end
+    table.sort(order, function(a, b) return addr(a) < addr(b) end)
+
+    -- find 8 callbacks laid out back to back
+    local run, stride
+    for j = 1, 33 do
+        local s = addr(order[j+1]) - addr(order[j])
+        local same = true
+        for k = j + 2, j + 7 do
+            same = same and addr(order[k]) - addr(order[k-1]) == s
+        end
+        if same then
+            run, stride = j, s
+            break
+        end
+    end
+    assert(run)
+
+    -- free the middle 6 alternately, leaving the ends live
+    local before = ffi.jitstats()
+    for k = 1, 6, 2 do
+        cbs[order[run + k]]:free()
+    end
+    check(ffi.jitstats().free_chunks, before.free_chunks + 3)
+    for k = 2, 6, 2 do
+        cbs[order[run + k]]:free()
+    end
+    local after = ffi.jitstats()
+    check(after.free_chunks, before.free_chunks + 1)
+    assert(after.largest_free >= 6 * stride)
+
+    -- which leaves room for a chunk spanning them
+    local args = {}
+    for j = 1, 24 do args[j] = 'double' end
+    local big = ffi.cast('double (*)(' .. table.concat(args, ',') .. ')', function(...) return select('#', ...) end)
+    local big_addr = tonumber(ffi.cast('intptr_t', big))
+    assert(big_addr > addr(order[run]) and big_addr < addr(order[run + 7]))
+    check(ffi.jitstats().pages, after.pages)
+    big:free()
+    for k = 0, 7, 7 do
+        cbs[order[run + k]]:free()
+    end
+    for j = 1, 40 do
+        if j < run or j > run + 7 then
+            cbs[order[j]]:free()
+        end
+    end
+end
+
+-- cdef cache, an unwritable directory just means nothing is saved
+local dir = os.tmpname()
+check(ffi.cachedir(dir), nil)
+ffi.cdef 'struct cachetest { int a; };'
+check(ffi.new('struct cachetest', 3).a, 3)
+check(ffi.cachedir(nil), dir)
+os.remove(dir)
+
+-- the cache has to be set before the first cdef, so save and load it in
+-- fresh processes. The second run loads the cdefs, which have to fit in with
+-- the types created between them.
+os.execute('mkdir ' .. dir)
+local f = io.open(dir .. '/child.lua', 'w')
+f:write [=[
+local ffi = require 'ffi'
+local warm = arg[2] == 'warm' or nil
+ffi.cachedir(arg[1])
+assert(ffi.cdef 'struct cachefoo { int a; }; struct cachefwd;' == warm)
+local before = ffi.new('struct cachefoo', 5)
+local fwd = ffi.typeof('struct cachefwd')
+assert(ffi.cdef [[
+struct cachefwd { int a, b; };
+typedef int (*cachefoo_get)(struct cachefoo*);
+enum { CACHE_SEVEN = 7 };
+]] == warm)
+local get = ffi.cast('cachefoo_get', function(p) return p.a end)
+assert(get(before) == 5)
+assert(ffi.sizeof(fwd) == 8 and ffi.new(fwd, 1, 2).b == 2)
+assert(ffi.C.CACHE_SEVEN == 7)
+]=]
+f:close()
+for _, run in ipairs{'cold', 'warm'} do
+    local ret = os.execute(string.format('%s %s/child.lua %s %s', arg[-1] or 'lua', dir, dir, run))
+    assert(ret == 0 or ret == true, run)
+end
+os.execute('rm -r ' .. dir)
+
+-- numeric members are read and written through a fast path
+ffi.cdef [[
+#pragma pack(push)
+#pragma pack(1)
+struct fastmbr {
+    char pad;
+    bool b;
+    uint8_t u8;
+    int16_t i16;
+    uint32_t u32;
+    float f;
+    double d;
+    enum e8 e;
+    const int c;
+    unsigned bf : 3;
+    bool bb : 1;
+};
+#pragma pack(pop)
+]]
+local s = ffi.new('struct fastmbr')
+local p = ffi.cast('struct fastmbr*', s)
+s.b = 2; check(s.b, true)
+p.b = false; check(s.b, false)
+s.u8 = 257; check(p.u8, 1)
+s.i16 = -2; check(s.i16, -2)
+s.u32 = -1; check(s.u32, 2^32 - 1)
+s.f = 0.1; check(s.f, ffi.new('float[1]', 0.1)[0])
+s.d = 0.1; check(s.d, 0.1)
+s.e = 'BAR8'; check(s.e, 1)
+s.bf = 9; check(s.bf, 1)
+s.bb = true; check(s.bb, true)
+check(pcall(function() s.c = 1 end), false)
+check(pcall(function() return s.missing end), false)
+
+-- cdata only get a finalizer once they need one
+local collected = 0
+local function count() collected = collected + 1 end
+ffi.cdef 'struct gctest { int a; };'
+ffi.metatype('struct gctest', {__gc = count})
+ffi.gc(ffi.new('int', 1), count)
+ffi.new('struct gctest')
+ffi.gc(ffi.gc(ffi.new('int', 2), count), nil)
+collectgarbage()
+collectgarbage()
+check(collected, 2)
+check(ffi.debug().cdata_mt.__gc, nil)
+assert(ffi.debug().cdata_gc_mt.__gc)
+
+-- type strings are parsed once and cached until the next cdef
+ffi.cdef 'struct cached_incomplete;'
+check(pcall(ffi.sizeof, 'struct cached_incomplete'), false)
+ffi.cdef 'struct cached_incomplete { int a, b; };'
+check(ffi.sizeof('struct cached_incomplete'), 8)
+check(ffi.new('struct cached_incomplete', 1, 2).b, 2)
+for j = 1, 600 do
+    check(ffi.sizeof('uint8_t[' .. j .. ']'), j)
+end
+check(ffi.sizeof('uint8_t[1]'), 1)
+-- but each anonymous struct is still its own type
+local anon1 = ffi.typeof('struct { int a; }')
+local anon2 = ffi.typeof('struct { int a; }')
+ffi.metatype(anon1, {__index = {get = function(s) return s.a end}})
+check(ffi.new(anon1, 4):get(), 4)
+assert(not pcall(function() return ffi.new(anon2, 4):get() end))
+
+-- arena cdata are references into the arena's block until it is reset
+ffi.cdef 'struct arenatest { int a; double d; };'
+local arena = ffi.arena(64)
+local at = arena:new('struct arenatest', 1, 2.5)
+check(at.a, 1)
+check(at.d, 2.5)
+check(ffi.sizeof(at), 16)
+local aa = arena:new('char[?]', 3, {1, 2})
+check(aa[0], 1)
+check(aa[2], 0)
+check(arena:used(), 19)
+local ab = arena:new('int[2]')
+check(tonumber(ffi.cast('uintptr_t', ab)) % 4, 0)
+check(arena:used(), 28)
+check(pcall(arena.new, arena, 'int'), false)
+check(pcall(arena.new, arena, 'char[64]'), false)
+arena:reset()
+check(arena:used(), 0)
+check(arena:new('struct arenatest').a, 0)
+-- after a reset arena:new reuses the reference from the same call before
+-- it if the ctype argument is the same and there are no initializers
+arena:reset()
+local r1 = arena:new('int[2]')
+r1[1] = 5
+local r2 = arena:new('struct arenatest')
+arena:reset()
+check(rawequal(arena:new('int[2]'), r1), true)
+check(r1[1], 0)
+local r3 = arena:new('int[3]')
+check(rawequal(r3, r2), false)
+check(ffi.sizeof(r3), 12)
+check(arena:used(), 20)
+arena:reset()
+check(rawequal(arena:new('int[2]', {1, 2}), r1), false)
+check(pcall(arena.new, {}, 'int[1]'), false)
+local weak_arena = setmetatable({ffi.arena(64)}, {__mode = 'v'})
+local aref = weak_arena[1]:new('int[4]', {1, 2, 3, 4})
+collectgarbage()
+collectgarbage()
+assert(weak_arena[1])
+check(aref[3], 4)
+aref = nil
+collectgarbage()
+collectgarbage()
+check(weak_arena[1], nil)
+
+-- ffi.alloc is ffi.new without zeroing or initializers
+local al = ffi.alloc('uint8_t[?]', 100)
+check(ffi.sizeof(al), 100)
+ffi.fill(al, 100, 7)
+check(al[99], 7)
+check(ffi.sizeof(ffi.alloc('struct arenatest')), 16)
+check(pcall(ffi.alloc, 'int[2]', 1), false)
+collected = 0
+ffi.alloc('struct gctest')
+collectgarbage()
+collectgarbage()
+check(collected, 1)
+
+-- over aligned types go up to the page size and their cdata are aligned
+ffi.cdef [[
+typedef double align64_t __attribute__((aligned(64)));
+struct align64 { int a; } __attribute__((aligned(64)));
+struct __attribute__((aligned(32))) align32 { int a; };
+struct align64_outer { char c; struct align64 s; };
+]]
+check(ffi.alignof('align64_t'), 64)
+check(ffi.alignof('struct align64'), 64)
+check(ffi.sizeof('struct align64'), 64)
+check(ffi.alignof('struct align32'), 32)
+check(ffi.offsetof('struct align64_outer', 's'), 64)
+check(ffi.alignof('struct align64_outer'), 64)
+local function addr(p) return tonumber(ffi.cast('uintptr_t', ffi.cast('void*', p))) end
+for j = 1, 8 do
+    check(addr(ffi.new('struct align64', j)) % 64, 0)
+    check(addr(ffi.new('align64_t[?]', j)) % 64, 0)
+    check(addr(ffi.alloc('struct align32[2]')) % 32, 0)
+    check(addr(ffi.new('struct align32[?]', 2, {{j}, {j}})) % 32, 0)
+end
+local a64 = ffi.new('struct align64', 3)
+check(a64.a, 3)
+check(ffi.sizeof(a64), 64)
+check(tostring(ffi.typeof(a64)):match('&'), nil)
+check(ffi.new(ffi.typeof(a64), 4).a, 4)
+check(pcall(ffi.cdef, 'struct badalign { int a; } __attribute__((aligned(3)));'), false)
+check(pcall(ffi.cdef, 'struct badalign { int a; } __attribute__((aligned(8192)));'), false)
+
+-- ffi.largealloc maps big structs, unions and arrays from the OS
+check(ffi.largealloc(64 * 1024), nil)
+local large_mt = ffi.debug().cdata_large_mt
+for _, huge in ipairs{'none', 'madvise', 'hugetlb'} do
+    ffi.largealloc(64 * 1024, huge)
+    local big = ffi.new('double[?]', 64 * 1024)
+    check(debug.getmetatable(big), large_mt)
+    check(addr(big) % 4096, 0)
+    check(big[0], 0)
+    check(big[64 * 1024 - 1], 0)
+    big[12345] = 1.5
+    check(big[12345], 1.5)
+    check(ffi.sizeof(big), 8 * 64 * 1024)
+    check(debug.getmetatable(ffi.alloc('uint8_t[?]', 64 * 1024)), large_mt)
+end
+check(debug.getmetatable(ffi.new('double[?]', 8)), ffi.debug().cdata_mt)
+ffi.cdef 'struct gcbig { int a[16384]; };'
+ffi.metatype('struct gcbig', {__gc = count})
+collectgarbage()
+collected = 0
+ffi.gc(ffi.new('uint8_t[?]', 64 * 1024), count)
+check(debug.getmetatable(ffi.new('struct gcbig')), large_mt)
+collectgarbage()
+collectgarbage()
+check(collected, 2)
+check(ffi.largealloc(), 64 * 1024)
+check(debug.getmetatable(ffi.new('double[?]', 64 * 1024)), ffi.debug().cdata_mt)
+
+-- finalizers run while ffi.bind is compiling can call into jit code
+do
+    local names, decl = {}, {}
+    for n = 1, 40 do
+        local args = {}
+        for i = 1, n do args[i] = 'int8_t' end
+        for i = 1, n % 3 do args[#args + 1] = 'float' end
+        decl[n] = ('double bindgc_%d(%s) __asm__("add_d");'):format(n, table.concat(args, ', '))
+        names[n] = 'bindgc_' .. n
+    end
+    ffi.cdef(table.concat(decl, '\n'))
+    local f = dlls.__cdecl.add_d
+    local called = 0
+    local pause = collectgarbage('setpause', 10)
+    local stepmul = collectgarbage('setstepmul', 1000)
+    for j = 1, 5000 do
+        ffi.gc(ffi.new('int[1]'), function() called = called + f(1, 0) end)
+    end
+    ffi.bind(dlls.__cdecl, names)
+    collectgarbage('setpause', pause)
+    collectgarbage('setstepmul', stepmul)
+    collectgarbage()
+    check(called, 5000)
+end
+
 
 print('Test PASSED')
 